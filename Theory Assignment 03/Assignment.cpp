@@ -17,9 +17,285 @@ the linked list and tree are properly cleaned up after use.
 #include <vector>
 #include <unordered_map>
 #include <sstream>
+#include <map>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <atomic>
+#include <condition_variable>
+#include <algorithm>
+#include <cstdlib>
+#include <chrono>
+#include <queue>
+#include <random>
+#include <functional>
+#include <fstream>
+#include <array>
+#include <cstdint>
+#include <cmath>
+#include <cstring>
+#include <new>
+
+#ifdef __linux__
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <sys/mman.h>
+#include <sys/ioctl.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <cerrno>
+#include <linux/userfaultfd.h>
+#ifndef UFFD_USER_MODE_ONLY
+#define UFFD_USER_MODE_ONLY 1  // Older headers; lets unprivileged users take user-mode faults
+#endif
+#endif
+
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 33))
+#include <malloc.h>
+#define HUFFMAN_MALLINFO2 1  // Heap statistics for the soak tool
+#endif
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define HUFFMAN_X86_KERNELS 1  // Build the SIMD kernels, picked at runtime
+#endif
 
 using namespace std;
 
+// ByteSegment and MutableSegment describe one buffer of an iovec-style list,
+// so chained buffers can be encoded and decoded without joining them first
+struct ByteSegment {
+    const char* data;  // Start of the buffer
+    size_t length;  // Number of bytes in the buffer
+};
+
+struct MutableSegment {
+    char* data;  // Start of the buffer
+    size_t length;  // Capacity of the buffer in bytes
+};
+
+// Histogram kernels count the bytes of a buffer into hist[256], adding to the
+// counts already there. FrequencyTable uses whichever kernel is active.
+typedef void (*HistogramKernel)(const unsigned char* data, size_t n, uint32_t hist[256]);
+
+// One counter array: every increment depends on the previous one when bytes repeat
+void histogramScalar(const unsigned char* data, size_t n, uint32_t hist[256]) {
+    for (size_t i = 0; i < n; i++) hist[data[i]]++;
+}
+
+// Four counter arrays updated in turn, so runs of the same byte do not
+// serialize on one memory location; the arrays are summed at the end
+void histogramMultiLane(const unsigned char* data, size_t n, uint32_t hist[256]) {
+    uint32_t lanes[4][256] = {{0}};
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        lanes[0][data[i]]++;
+        lanes[1][data[i + 1]]++;
+        lanes[2][data[i + 2]]++;
+        lanes[3][data[i + 3]]++;
+    }
+    for (; i < n; i++) lanes[0][data[i]]++;
+    for (int c = 0; c < 256; c++) hist[c] += lanes[0][c] + lanes[1][c] + lanes[2][c] + lanes[3][c];
+}
+
+#ifdef HUFFMAN_X86_KERNELS
+// AVX-512 kernel: 16 bytes are widened to 16 indices, the current counts are
+// gathered, and VPCONFLICTD gives each lane a mask of the earlier lanes with
+// the same byte. A lane adds 1 plus the number of those lanes; scatter stores
+// to one address land in lane order, so the last duplicate, which carries the
+// full count, is the one that remains. The AVX-512 kernels use the masked
+// forms of intrinsics with all lanes set: the plain forms in GCC 12 pass an
+// "undefined" vector that -Wall reports as uninitialized.
+__attribute__((target("avx512f,avx512cd,avx512bw")))
+void histogramConflict(const unsigned char* data, size_t n, uint32_t hist[256]) {
+    const __mmask16 all = 0xFFFF;
+    const __m512i nibbleCounts = _mm512_maskz_broadcast_i32x4(all, _mm_setr_epi8(0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4));
+    const __m512i lowNibble = _mm512_set1_epi8(0x0F);
+    const __m512i byteMask = _mm512_set1_epi32(0xFF);
+    const __m512i one = _mm512_set1_epi32(1);
+    size_t i = 0;
+
+    for (; i + 16 <= n; i += 16) {
+        __m512i index = _mm512_maskz_cvtepu8_epi32(all, _mm_loadu_si128((const __m128i*)(data + i)));
+        __m512i conflicts = _mm512_conflict_epi32(index);
+
+        // Population count of the conflict masks, which only use the low 16 bits
+        __m512i low = _mm512_shuffle_epi8(nibbleCounts, _mm512_and_si512(conflicts, lowNibble));
+        __m512i high = _mm512_shuffle_epi8(nibbleCounts, _mm512_and_si512(_mm512_srli_epi16(conflicts, 4), lowNibble));
+        __m512i bytes = _mm512_add_epi8(low, high);
+        __m512i earlier = _mm512_add_epi32(_mm512_and_si512(bytes, byteMask),
+                                           _mm512_and_si512(_mm512_maskz_srli_epi32(all, bytes, 8), byteMask));
+
+        __m512i counts = _mm512_mask_i32gather_epi32(_mm512_setzero_si512(), all, index, (const int*)hist, 4);
+        counts = _mm512_add_epi32(counts, _mm512_add_epi32(earlier, one));
+        _mm512_i32scatter_epi32((int*)hist, index, counts, 4);
+    }
+    for (; i < n; i++) hist[data[i]]++;
+}
+#endif
+
+// Kernels this CPU can run, by the names used in tuning profiles
+vector<pair<string, HistogramKernel>> availableHistogramKernels() {
+    vector<pair<string, HistogramKernel>> kernels = {{"scalar", histogramScalar}, {"multi-lane", histogramMultiLane}};
+#ifdef HUFFMAN_X86_KERNELS
+    if (__builtin_cpu_supports("avx512cd") && __builtin_cpu_supports("avx512bw")) {
+        kernels.push_back(make_pair(string("avx512 conflict"), histogramConflict));
+    }
+#endif
+    return kernels;
+}
+
+// TuningProfile holds the choices the autotune tool measured on one CPU model.
+// The defaults below apply until a profile for this CPU is loaded.
+struct TuningProfile {
+    string cpu;  // CPU model the profile was measured on
+    string histogram;  // Histogram kernel name
+    int decodeWays;  // Interleave width of HuffmanTree::decodeInterleaved
+    size_t blockSize;  // Default block size of StreamingEncoder
+};
+
+// Profile in effect for this process
+TuningProfile& tuningProfile() {
+    static TuningProfile profile = {"", "multi-lane", 4, 65535};
+    return profile;
+}
+
+// Kernel used by FrequencyTable. Multi-lane is the default: on the CPUs
+// measured with bench-histogram the gather/scatter latency of the conflict
+// kernel outweighs its savings. Assign to this to pick another kernel.
+HistogramKernel& activeHistogramKernel() {
+    static HistogramKernel kernel = histogramMultiLane;
+    return kernel;
+}
+
+// Count the bytes of a buffer with the active kernel
+void countHistogram(const char* data, size_t n, uint32_t hist[256]) {
+    activeHistogramKernel()((const unsigned char*)data, n, hist);
+}
+
+// Adler-32 checksum of a buffer, continuing from a previous value (start with 1)
+uint32_t adler32(const char* data, size_t n, uint32_t previous = 1) {
+    const uint32_t MOD = 65521;
+    uint32_t a = previous & 0xFFFF, b = previous >> 16;
+    while (n > 0) {
+        size_t chunk = min<size_t>(n, 5552);  // Largest run before the sums can overflow
+        for (size_t i = 0; i < chunk; i++) {
+            a += (unsigned char)data[i];
+            b += a;
+        }
+        a %= MOD;
+        b %= MOD;
+        data += chunk;
+        n -= chunk;
+    }
+    return b << 16 | a;
+}
+
+// IngestBuffer receives the input of one block in a single pass: every byte
+// is copied into a 64-byte aligned buffer while the histogram and an Adler-32
+// checksum are updated in the same loop. The block can then be turned into a
+// frequency table and encoded without reading the source again.
+class IngestBuffer {
+private:
+    char* data;  // Aligned block buffer
+    size_t length;  // Bytes ingested so far
+    size_t capacity;  // Size of the buffer
+    uint32_t lanes[4][256];  // Multi-lane histogram, summed by histogram()
+    uint32_t a, b;  // Adler-32 sums
+
+    static char* allocate(size_t size) { return static_cast<char*>(::operator new(size, align_val_t(64))); }
+    static void release(char* p) { ::operator delete(p, align_val_t(64)); }
+
+    void reserve(size_t needed) {
+        if (needed <= capacity) return;
+        size_t grown = max(needed, capacity * 2);
+        char* bigger = allocate(grown);
+        copy(data, data + length, bigger);
+        release(data);
+        data = bigger;
+        capacity = grown;
+    }
+
+public:
+    explicit IngestBuffer(size_t blockSize = 1 << 16) {
+        capacity = max<size_t>(blockSize, 64);
+        data = allocate(capacity);
+        reset();
+    }
+
+    ~IngestBuffer() { release(data); }
+
+    IngestBuffer(const IngestBuffer&) = delete;
+    IngestBuffer& operator=(const IngestBuffer&) = delete;
+
+    // Start a new block, keeping the buffer
+    void reset() {
+        length = 0;
+        a = 1;
+        b = 0;
+        for (uint32_t* lane : lanes) fill(lane, lane + 256, 0);
+    }
+
+    // Copy, count and checksum source bytes in one pass
+    void ingest(const char* source, size_t n) {
+        const uint32_t MOD = 65521;
+        reserve(length + n);
+        unsigned char* out = (unsigned char*)data + length;
+        const unsigned char* in = (const unsigned char*)source;
+        length += n;
+
+        while (n > 0) {
+            size_t chunk = min<size_t>(n, 5552);
+            size_t i = 0;
+            for (; i + 4 <= chunk; i += 4) {
+                unsigned char c0 = in[i], c1 = in[i + 1], c2 = in[i + 2], c3 = in[i + 3];
+                out[i] = c0;
+                out[i + 1] = c1;
+                out[i + 2] = c2;
+                out[i + 3] = c3;
+                lanes[0][c0]++;
+                lanes[1][c1]++;
+                lanes[2][c2]++;
+                lanes[3][c3]++;
+                a += c0;
+                b += a;
+                a += c1;
+                b += a;
+                a += c2;
+                b += a;
+                a += c3;
+                b += a;
+            }
+            for (; i < chunk; i++) {
+                out[i] = in[i];
+                lanes[0][in[i]]++;
+                a += in[i];
+                b += a;
+            }
+            a %= MOD;
+            b %= MOD;
+            in += chunk;
+            out += chunk;
+            n -= chunk;
+        }
+    }
+
+    void ingest(const string& source) { ingest(source.data(), source.length()); }
+
+    // Byte counts of everything ingested since reset()
+    void histogram(uint32_t counts[256]) const {
+        for (int c = 0; c < 256; c++) counts[c] = lanes[0][c] + lanes[1][c] + lanes[2][c] + lanes[3][c];
+    }
+
+    // Adler-32 checksum of everything ingested since reset()
+    uint32_t checksum() const { return b << 16 | a; }
+
+    const char* getData() const { return data; }
+    size_t getLength() const { return length; }
+    ByteSegment segment() const { return ByteSegment{data, length}; }
+};
+
 // Node class represents a character and its frequency in the linked list
 class Node{
     private:
@@ -55,7 +331,10 @@ class FrequencyTable{
     FrequencyTable() { head = nullptr; }
 
     // Destructor to free memory by deleting the nodes in the linked list
-    ~FrequencyTable() {
+    ~FrequencyTable() { Clear(); }
+
+    // Delete every node so the table can be filled again
+    void Clear() {
         Node *p = head;
         Node *q;
         while(p != nullptr) {
@@ -70,45 +349,77 @@ class FrequencyTable{
     void sethuffmanString(string s) { this->huffmanString = s; }
     string gethuffmanString() { return this->huffmanString; }
 
-    // Create a frequency table by counting occurrences of each character
-    void MakeTable() {
-        if (isEmpty()) {
-            if (huffmanString.empty()) {
-                cout << "\nError! Huffman String is Empty!";
+    // Add f occurrences of a character, appending a new node the first time it is seen
+    void AddFrequency(char Character, int f) {
+        Node* temp = head;
+
+        while (temp != nullptr) {
+            if (temp->getChar() == Character) {
+                temp->setfreq(temp->getFreq() + f);
                 return;
             }
+            temp = temp->getNext();
+        }
+
+        // If character is not found, create a new node and add it to the list
+        Node* newNode = new Node(Character, f);
+        if (head == nullptr) {
+            head = newNode;
+        } else {
+            Node* current = head;
+            while (current->getNext() != nullptr) {
+                current = current->getNext();
+            }
+            current->setNext(newNode);
+        }
+    }
 
-            // Loop through the input string and update the frequency table
-            for (int i = 0; i < huffmanString.length(); i++) {
-                char Character = huffmanString[i];
-                Node* temp = head;
-                bool found = false;
+    // Create a frequency table by counting occurrences of each character
+    void MakeTable() {
+        MakeTable(vector<ByteSegment>(1, ByteSegment{huffmanString.data(), huffmanString.length()}));
+    }
 
-                while (temp != nullptr) {
-                    if (temp->getChar() == Character) {
-                        temp->setfreq(temp->getFreq() + 1);
-                        found = true;
-                        break;
-                    }
-                    temp = temp->getNext();
-                }
+    // Create a frequency table from a list of buffers, as if they were one string.
+    // The bytes are counted by the active histogram kernel, then a second scan
+    // finds the order of first appearance and stops as soon as every counted
+    // character was seen, so the table matches the one built one character at a time.
+    void MakeTable(const vector<ByteSegment>& segments) {
+        if (!isEmpty()) {
+            cout << "\nTable is already populated!";
+            return;
+        }
 
-                // If character is not found, create a new node and add it to the list
-                if (!found) {
-                    Node* newNode = new Node(Character, 1);
-                    if (head == nullptr) {
-                        head = newNode;
-                    } else {
-                        Node* current = head;
-                        while (current->getNext() != nullptr) {
-                            current = current->getNext();
-                        }
-                        current->setNext(newNode);
-                    }
-                }
-            }
-        } else {
+        uint32_t counts[256] = {0};
+        for (const ByteSegment& segment : segments) {
+            countHistogram(segment.data, segment.length, counts);
+        }
+        LoadCounts(counts, segments);
+    }
+
+    // Fill an empty table from byte counts already computed for the buffers,
+    // in order of first appearance in the buffers
+    void LoadCounts(const uint32_t counts[256], const vector<ByteSegment>& segments) {
+        bool seen[256] = {false};
+        int distinct = 0;
+
+        if (!isEmpty()) {
             cout << "\nTable is already populated!";
+            return;
+        }
+        for (int c = 0; c < 256; c++) distinct += counts[c] > 0;
+        if (distinct == 0) {
+            cout << "\nError! Huffman String is Empty!";
+            return;
+        }
+
+        for (const ByteSegment& segment : segments) {
+            for (size_t i = 0; i < segment.length && distinct > 0; i++) {
+                unsigned char c = segment.data[i];
+                if (seen[c]) continue;
+                seen[c] = true;
+                distinct--;
+                AddFrequency(c, counts[c]);
+            }
         }
     }
 
@@ -158,7 +469,52 @@ struct HuffmanNode {
     }
 };
 
-// PriorityQueue class manages the min-heap structure for building the Huffman tree
+// DecodeEntry is one slot of the flattened decode table built from the Huffman tree.
+// Children are stored as indices into the table instead of pointers, so several
+// independent decoders can walk the same table without chasing heap pointers.
+struct DecodeEntry {
+    int child[2];  // Index of the left ('0') and right ('1') child, -1 if absent
+    char Character;  // Character stored at a leaf
+    bool isLeaf;  // True if this entry is a leaf of the tree
+};
+
+// LookupEntry is one slot of the hardened decoder's multi-level table,
+// indexed by the next LOOKUP_BITS bits of input
+struct LookupEntry {
+    uint32_t value;  // Character of a leaf, or start of the next-level table
+    uint16_t length;  // Bits consumed by this entry
+    uint16_t kind;  // LEAF, NEXT_LEVEL or INVALID
+};
+
+// Pack a bit string into bytes, most significant bit first, padding the last byte with zeros
+string packBits(const string& bits) {
+    string bytes((bits.length() + 7) / 8, '\0');
+    size_t i = 0;
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    // Eight characters at a time: keep the low bit of each and gather them into one byte
+    for (; i + 8 <= bits.length(); i += 8) {
+        uint64_t word;
+        memcpy(&word, bits.data() + i, 8);
+        bytes[i >> 3] = (char)(((word & 0x0101010101010101ULL) * 0x8040201008040201ULL) >> 56);
+    }
+#endif
+    for (; i < bits.length(); i++) {
+        if (bits[i] == '1') bytes[i >> 3] |= (char)(0x80 >> (i & 7));
+    }
+    return bytes;
+}
+
+// Expand bytes written by packBits() back into a bit string
+string unpackBits(const char* bytes, size_t n) {
+    string bits(n * 8, '0');
+    for (size_t i = 0; i < n * 8; i++) {
+        if ((bytes[i >> 3] >> (7 - (i & 7))) & 1) bits[i] = '1';
+    }
+    return bits;
+}
+
+// PriorityQueue class manages the min-heap structure for building the Huffman tree.
+// The tree builder now uses DaryHeap; this class is kept as the baseline of bench-heap.
 class PriorityQueue {
 public:
     vector<HuffmanNode*> queue;  // Vector to hold the Huffman nodes (min-heap)
@@ -183,10 +539,10 @@ private:
         int left = 2 * index + 1;
         int right = 2 * index + 2;
 
-        if (left < queue.size() && queue[left]->freq < queue[smallest]->freq) {
+        if ((size_t)left < queue.size() && queue[left]->freq < queue[smallest]->freq) {
             smallest = left;
         }
-        if (right < queue.size() && queue[right]->freq < queue[smallest]->freq) {
+        if ((size_t)right < queue.size() && queue[right]->freq < queue[smallest]->freq) {
             smallest = right;
         }
         if (smallest != index) {
@@ -216,11 +572,388 @@ public:
     bool isEmpty() { return queue.empty(); }
 };
 
+// DaryHeap is a generic min-heap with D children per node over compact
+// (key, index) pairs. The index names an element in an array owned by the
+// caller, so the heap never dereferences pointers while comparing. Ties on the
+// key are broken by the smaller index, which makes the pop order deterministic.
+template <typename Key, int D = 4>
+class DaryHeap {
+public:
+    // One heap slot: the priority and the caller's element index
+    struct Entry {
+        Key key;
+        int index;
+    };
+
+private:
+    vector<Entry> heap;  // Slots in heap order, the minimum at slot 0
+    vector<int> position;  // position[index] = slot of the element, -1 if absent
+    bool trackPositions;  // Maintain position[] so decreaseKey() can be used
+
+    static bool less(const Entry& a, const Entry& b) {
+        return a.key < b.key || (!(b.key < a.key) && a.index < b.index);
+    }
+
+    // Store an entry in a slot, keeping its position up to date
+    void place(size_t slot, const Entry& entry) {
+        heap[slot] = entry;
+        if (trackPositions) position[entry.index] = slot;
+    }
+
+    // Move the entry at slot towards the root until its parent is smaller
+    void siftUp(size_t slot) {
+        Entry entry = heap[slot];
+        while (slot > 0) {
+            size_t parent = (slot - 1) / D;
+            if (!less(entry, heap[parent])) break;
+            place(slot, heap[parent]);
+            slot = parent;
+        }
+        place(slot, entry);
+    }
+
+    // Move the entry at slot towards the leaves until no child is smaller
+    void siftDown(size_t slot) {
+        Entry entry = heap[slot];
+        size_t count = heap.size();
+        while (true) {
+            size_t first = slot * D + 1;
+            if (first >= count) break;
+
+            size_t last = min(first + D, count);
+            size_t smallest = first;
+            for (size_t child = first + 1; child < last; child++) {
+                if (less(heap[child], heap[smallest])) smallest = child;
+            }
+            if (!less(heap[smallest], entry)) break;
+
+            place(slot, heap[smallest]);
+            slot = smallest;
+        }
+        place(slot, entry);
+    }
+
+    // Make sure position[] can hold the given element index
+    void reservePosition(int index) {
+        if (trackPositions && index >= (int)position.size()) position.resize(index + 1, -1);
+    }
+
+public:
+    // Create an empty heap; decreaseKey() needs trackPositions
+    explicit DaryHeap(bool trackPositions = false) { this->trackPositions = trackPositions; }
+
+    // Build a heap from an array of entries in O(n)
+    explicit DaryHeap(const vector<Entry>& entries, bool trackPositions = false) : heap(entries) {
+        this->trackPositions = trackPositions;
+        for (const Entry& entry : heap) reservePosition(entry.index);
+        if (trackPositions) {
+            for (size_t slot = 0; slot < heap.size(); slot++) position[heap[slot].index] = slot;
+        }
+        for (size_t slot = heap.size() / D + 1; slot-- > 0;) {
+            if (slot < heap.size()) siftDown(slot);
+        }
+    }
+
+    // Reserve room for n entries
+    void reserve(size_t n) { heap.reserve(n); }
+
+    // Insert an element with the given key
+    void push(Key key, int index) {
+        reservePosition(index);
+        heap.push_back({key, index});
+        siftUp(heap.size() - 1);
+    }
+
+    // Smallest entry; the heap must not be empty
+    const Entry& top() const { return heap[0]; }
+
+    // Remove and return the smallest entry; the heap must not be empty
+    Entry pop() {
+        Entry result = heap[0];
+        if (trackPositions) position[result.index] = -1;
+
+        Entry last = heap.back();
+        heap.pop_back();
+        if (!heap.empty()) {
+            heap[0] = last;
+            siftDown(0);
+        }
+        return result;
+    }
+
+    // Check whether an element is in the heap; needs trackPositions
+    bool contains(int index) const {
+        return index >= 0 && index < (int)position.size() && position[index] >= 0;
+    }
+
+    // Lower the key of an element already in the heap; needs trackPositions.
+    // A key that is not smaller than the current one is ignored.
+    void decreaseKey(int index, Key key) {
+        if (!contains(index)) return;
+        size_t slot = position[index];
+        if (!(key < heap[slot].key)) return;
+        heap[slot].key = key;
+        siftUp(slot);
+    }
+
+    size_t size() const { return heap.size(); }
+    bool isEmpty() const { return heap.empty(); }
+};
+
 // HuffmanTree class is responsible for building the Huffman tree and generating codes
 class HuffmanTree {
 private:
     HuffmanNode* root;  // Root node of the Huffman tree
     string encodedString;  // Encoded string after Huffman encoding
+    vector<DecodeEntry> decodeTable;  // Flattened copy of the tree, root at index 0
+    vector<LookupEntry> lookup;  // Tables of the hardened decoder, first level at index 0
+    int maxCodeLength;  // Longest code in bits
+    int minCodeLength;  // Shortest code in bits, at most LOOKUP_BITS
+
+    // Helper function to free the nodes of a subtree
+    void destroy(HuffmanNode* node) {
+        if (!node) return;
+        destroy(node->left);
+        destroy(node->right);
+        delete node;
+    }
+
+    // Helper function to write a subtree for serialize()
+    void serializeNode(HuffmanNode* node, string& bits) {
+        if (!node) return;
+        if (!node->left && !node->right) {
+            bits += '1';
+            for (int i = 7; i >= 0; i--) bits += ((node->Character >> i) & 1) ? '1' : '0';
+            return;
+        }
+        bits += '0';
+        serializeNode(node->left, bits);
+        serializeNode(node->right, bits);
+    }
+
+    // Helper function to read a subtree for deserialize(); nullptr on malformed input
+    HuffmanNode* deserializeNode(const string& bits, size_t& pos, int depth, int& leaves) {
+        if (pos >= bits.length() || depth > 255 || leaves >= 256) return nullptr;
+
+        if (bits[pos++] == '1') {
+            if (pos + 8 > bits.length()) return nullptr;
+            int value = 0;
+            for (int i = 0; i < 8; i++) value = (value << 1) | (bits[pos++] == '1');
+            leaves++;
+            return new HuffmanNode((char)value, 0);
+        }
+
+        HuffmanNode* node = new HuffmanNode('\0', 0);
+        node->left = deserializeNode(bits, pos, depth + 1, leaves);
+        node->right = node->left ? deserializeNode(bits, pos, depth + 1, leaves) : nullptr;
+        if (!node->right) {
+            destroy(node);
+            return nullptr;
+        }
+        return node;
+    }
+
+    // Helper function to flatten the tree into the decode table in preorder
+    int buildDecodeTable(HuffmanNode* node) {
+        if (!node) return -1;
+
+        int index = decodeTable.size();
+        decodeTable.push_back({{-1, -1}, node->Character, !node->left && !node->right});
+
+        int left = buildDecodeTable(node->left);
+        int right = buildDecodeTable(node->right);
+        decodeTable[index].child[0] = left;
+        decodeTable[index].child[1] = right;
+        return index;
+    }
+
+    // Depth of the deepest leaf below a decode table entry
+    int depthBelow(int state) {
+        if (state < 0 || decodeTable[state].isLeaf) return 0;
+        return 1 + max(depthBelow(decodeTable[state].child[0]), depthBelow(decodeTable[state].child[1]));
+    }
+
+    // Depth of the shallowest leaf below a decode table entry, or limit if
+    // there is none above that depth
+    int leafDepthBelow(int state, int limit) {
+        if (state < 0 || limit == 0) return limit;
+        if (decodeTable[state].isLeaf) return 0;
+        return 1 + min(leafDepthBelow(decodeTable[state].child[0], limit - 1),
+                       leafDepthBelow(decodeTable[state].child[1], limit - 1));
+    }
+
+    // Add a table for the LOOKUP_BITS bits following a decode table entry.
+    // A missing child gives an INVALID entry, so every index leads somewhere.
+    size_t buildLookupLevel(int state) {
+        size_t base = lookup.size();
+        lookup.resize(base + (1 << LOOKUP_BITS));
+
+        for (uint32_t v = 0; v < (1u << LOOKUP_BITS); v++) {
+            int node = state;
+            int depth = 0;
+            while (depth < LOOKUP_BITS && node >= 0 && !decodeTable[node].isLeaf) {
+                node = decodeTable[node].child[(v >> (LOOKUP_BITS - 1 - depth)) & 1];
+                depth++;
+            }
+
+            LookupEntry entry = {0, (uint16_t)LOOKUP_BITS, INVALID};
+            if (node >= 0 && decodeTable[node].isLeaf) {
+                entry = {(unsigned char)decodeTable[node].Character, (uint16_t)depth, LEAF};
+            } else if (node >= 0) {
+                entry = {(uint32_t)buildLookupLevel(node), (uint16_t)LOOKUP_BITS, NEXT_LEVEL};
+            }
+            lookup[base + v] = entry;
+        }
+        return base;
+    }
+
+    // Rebuild the hardened decoder's tables from the decode table
+    void buildLookup() {
+        lookup.clear();
+        maxCodeLength = 0;
+        minCodeLength = 0;
+        if (decodeTable.empty() || decodeTable[0].isLeaf) return;
+        maxCodeLength = depthBelow(0);
+        minCodeLength = leafDepthBelow(0, LOOKUP_BITS);
+        buildLookupLevel(0);
+    }
+
+    // The bits of a packed buffer from bit pos on, at the top of a word; at
+    // least 57 of them are valid. The buffer must have 8 readable bytes from pos / 8.
+    static uint64_t loadWindow(const uint8_t* data, size_t pos) {
+        uint64_t word;
+        memcpy(&word, data + (pos >> 3), 8);
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+        word = __builtin_bswap64(word);
+#endif
+        return word << (pos & 7);
+    }
+
+    static uint32_t peekBits(const uint8_t* data, size_t pos) { return loadWindow(data, pos) >> (64 - LOOKUP_BITS); }
+
+    // One packed input being decoded through the lookup tables: its bits are
+    // read from a register window that is refilled when it runs low, so the
+    // memory load is not on the path from one code to the next. Only window,
+    // available and out change per code; the position is end - available.
+    struct LookupLane {
+        const uint8_t* data;  // Packed input with INPUT_PADDING readable bytes past its end
+        size_t bitCount;  // Bits of input
+        size_t end;  // Input position just past the bits loaded into window
+        uint64_t window;  // Unconsumed input bits, at the top
+        int available;  // Valid bits in window
+        char* out;  // Next output byte; the output holds at least outputBound(bitCount) bytes
+        uint32_t seen;  // OR of the kinds of all entries used
+    };
+
+    // Start decoding a packed input into dst
+    static LookupLane startLane(const uint8_t* data, size_t bitCount, char* dst) {
+        LookupLane lane = {data, bitCount, 64, loadWindow(data, 0), 64, dst, 0};
+        return lane;
+    }
+
+    // Reload the window of a lane from its current position
+    static void refill(LookupLane& lane) {
+        size_t pos = lane.end - lane.available;
+        lane.window = loadWindow(lane.data, pos);
+        lane.available = 64 - (pos & 7);
+        lane.end = pos + lane.available;
+    }
+
+    // Refill the window of a lane if it runs low and return the first-level
+    // entry of its next code. A whole worst-case code must fit before the end.
+    const LookupEntry* firstEntry(LookupLane& lane) const {
+        if (lane.available < 32) refill(lane);
+        return &lookup[lane.window >> (64 - LOOKUP_BITS)];
+    }
+
+    // Finish the code whose first-level entry is given: follow the next
+    // levels, consume its bits and write its symbol
+    void finishCode(LookupLane& lane, const LookupEntry* entry) const {
+        while (entry->kind == NEXT_LEVEL) {
+            lane.window <<= entry->length;
+            lane.available -= entry->length;
+            if (lane.available < LOOKUP_BITS) refill(lane);
+            entry = &lookup[entry->value + (lane.window >> (64 - LOOKUP_BITS))];
+        }
+        lane.window <<= entry->length;
+        lane.available -= entry->length;
+        lane.seen |= entry->kind;
+        *lane.out++ = (char)entry->value;
+    }
+
+    // Most symbols the lookup tables can produce from bitCount bits: a code
+    // takes at least minCodeLength bits and an INVALID entry LOOKUP_BITS
+    size_t outputBound(size_t bitCount) const { return bitCount / minCodeLength; }
+
+    // Any one code, valid or not, spans at most this many bits
+    size_t codeSpan() const { return (size_t)maxCodeLength + LOOKUP_BITS; }
+
+    // Codes a lane can start before a worst-case code no longer fits
+    size_t safeCodes(const LookupLane& lane) const {
+        size_t span = codeSpan(), pos = lane.end - lane.available;
+        return (pos + span <= lane.bitCount) ? (lane.bitCount - span - pos) / span + 1 : 0;
+    }
+
+    // Decode the rest of a lane: unchecked codes while a worst-case code fits,
+    // then the last few codes with the end of input checked at every level.
+    // A trailing incomplete code is ignored.
+    void finishLane(LookupLane& lane) const {
+        while (safeCodes(lane) > 0) {
+            for (size_t k = safeCodes(lane); k > 0; k--) finishCode(lane, firstEntry(lane));
+        }
+        size_t pos = lane.end - lane.available;
+        while (pos < lane.bitCount && !(lane.seen & INVALID)) {
+            size_t p = pos;
+            const LookupEntry* entry = &lookup[peekBits(lane.data, p)];
+            while (entry->kind == NEXT_LEVEL && p + entry->length < lane.bitCount) {
+                p += entry->length;
+                entry = &lookup[entry->value + peekBits(lane.data, p)];
+            }
+            if (entry->kind == NEXT_LEVEL || p + entry->length > lane.bitCount) break;
+            pos = p + entry->length;
+            lane.seen |= entry->kind;
+            *lane.out++ = (char)entry->value;
+        }
+    }
+
+    // Decode WAYS lanes in lock-step. The first-level loads of all lanes are
+    // issued before any of them is used, so their latencies overlap instead of
+    // each lane waiting on its own previous lookup. Once the shortest lane
+    // nears its end, every lane finishes on its own.
+    template <int WAYS>
+    void decodeLanes(LookupLane* lanes) const {
+        while (true) {
+            size_t steps = SIZE_MAX;
+            for (int l = 0; l < WAYS; l++) steps = min(steps, safeCodes(lanes[l]));
+            if (steps == 0) break;
+            for (; steps > 0; steps--) {
+                const LookupEntry* entry[WAYS];
+                for (int l = 0; l < WAYS; l++) entry[l] = firstEntry(lanes[l]);
+                for (int l = 0; l < WAYS; l++) finishCode(lanes[l], entry[l]);
+            }
+        }
+        for (int l = 0; l < WAYS; l++) finishLane(lanes[l]);
+    }
+
+    // Decode WAYS consecutive strings from first on. Their packed input and
+    // output go through the scratch buffers, reused from group to group so
+    // the working set stays in cache.
+    template <int WAYS>
+    void decodeGroup(const vector<string>& encoded, vector<string>& decoded, size_t first,
+                     string* packed, string* output) const {
+        LookupLane lanes[WAYS];
+        for (int l = 0; l < WAYS; l++) {
+            const string& bits = encoded[first + l];
+            packed[l] = packBits(bits);
+            packed[l].append(INPUT_PADDING, '\0');
+            if (output[l].length() < outputBound(bits.length())) output[l].resize(outputBound(bits.length()));
+            lanes[l] = startLane((const uint8_t*)packed[l].data(), bits.length(), &output[l][0]);
+        }
+        decodeLanes<WAYS>(lanes);
+        for (int l = 0; l < WAYS; l++) {
+            if (!(lanes[l].seen & INVALID)) decoded[first + l].assign(output[l].data(), lanes[l].out - output[l].data());
+        }
+    }
 
     // Helper function to build Huffman codes for each character
     void buildCodes(HuffmanNode* node, string code, unordered_map<char, string>& codes) {
@@ -242,33 +975,67 @@ private:
     }
 
 public:
+    static constexpr int LOOKUP_BITS = 10;  // Input bits resolved per table level
+    static constexpr size_t INPUT_PADDING = 8;  // Readable bytes decodePacked() needs past the input
+    static constexpr size_t MAX_TREE_BITS = 255 + 256 * 9;  // Longest tree deserialize() accepts
+    static constexpr size_t MAX_CODE_BITS = 255;  // Longest code in a tree deserialize() accepts
+    enum LookupKind { LEAF = 0, NEXT_LEVEL = 1, INVALID = 2 };
+
     // Constructor initializes root to nullptr
-    HuffmanTree() { root = nullptr; }
+    HuffmanTree() {
+        root = nullptr;
+        maxCodeLength = 0;
+        minCodeLength = 0;
+    }
+
+    // Destructor frees the nodes of the tree
+    ~HuffmanTree() { destroy(root); }
+
+    // The tree owns its nodes, so it cannot be copied
+    HuffmanTree(const HuffmanTree&) = delete;
+    HuffmanTree& operator=(const HuffmanTree&) = delete;
 
     // Build the Huffman tree from the frequency table
     void buildTree(FrequencyTable& table) {
-        PriorityQueue pq;
+        vector<HuffmanNode*> nodes;  // Every node of the tree, indexed by heap entries
+        vector<DaryHeap<int>::Entry> leaves;
         Node* p = table.getHead();
+        destroy(root);  // A rebuilt tree replaces the previous one
+        root = nullptr;
 
-        // Push each character and its frequency to the priority queue
+        // Create a leaf for each character and heapify all of them at once
         while (p != nullptr) {
-            pq.push(new HuffmanNode(p->getChar(), p->getFreq()));
+            leaves.push_back({p->getFreq(), (int)nodes.size()});
+            nodes.push_back(new HuffmanNode(p->getChar(), p->getFreq()));
             p = p->getNext();
         }
+        if (nodes.empty()) {
+            decodeTable.clear();
+            buildLookup();
+            return;
+        }
+
+        DaryHeap<int> pq(leaves);
+        pq.reserve(nodes.size());
 
         // Merge nodes with the lowest frequencies to create the tree
-        while (pq.queue.size() > 1) {
-            HuffmanNode* left = pq.pop();
-            HuffmanNode* right = pq.pop();
+        while (pq.size() > 1) {
+            HuffmanNode* left = nodes[pq.pop().index];
+            HuffmanNode* right = nodes[pq.pop().index];
 
             HuffmanNode* merged = new HuffmanNode('\0', left->freq + right->freq);
             merged->left = left;
             merged->right = right;
 
-            pq.push(merged);
+            pq.push(merged->freq, nodes.size());
+            nodes.push_back(merged);
         }
 
-        root = pq.pop();  // The remaining node is the root of the tree
+        root = nodes[pq.pop().index];  // The remaining node is the root of the tree
+
+        decodeTable.clear();
+        buildDecodeTable(root);
+        buildLookup();
     }
 
     // Generate Huffman codes for each character
@@ -285,55 +1052,5525 @@ public:
         return encodedString;
     }
 
-    // Decode the encoded string back to the original string
-    string decode(string encoded) {
-        string decoded;
-        HuffmanNode* current = root;
+    // Append the codes of a list of buffers to bits, as if they were one
+    // string. Returns false, appending nothing, if a byte has no code.
+    bool encode(const vector<ByteSegment>& segments, unordered_map<char, string>& codes, string& bits) {
+        const string* code[256];
+        size_t length = 0;
+
+        for (int c = 0; c < 256; c++) {
+            unordered_map<char, string>::iterator it = codes.find((char)c);
+            code[c] = (it == codes.end()) ? nullptr : &it->second;
+        }
+        for (const ByteSegment& segment : segments) {
+            for (size_t i = 0; i < segment.length; i++) {
+                const string* c = code[(unsigned char)segment.data[i]];
+                if (!c) return false;
+                length += c->length();
+            }
+        }
+
+        bits.reserve(bits.length() + length);
+        for (const ByteSegment& segment : segments) {
+            for (size_t i = 0; i < segment.length; i++) bits += *code[(unsigned char)segment.data[i]];
+        }
+        return true;
+    }
+
+    // Decode the encoded string into a list of caller buffers, filling each one
+    // before moving to the next, and set written to the characters written.
+    // A trailing incomplete code is ignored. Returns false if the bits cannot
+    // be decoded or the buffers fill up first, and for a one-leaf tree, whose
+    // zero-bit codes do not tell how many characters there are.
+    bool decode(const string& encoded, const vector<MutableSegment>& segments, size_t& written) {
+        size_t segment = 0;
+        size_t offset = 0;
+        int state = 0;
+
+        written = 0;
+        if (decodeTable.empty()) return encoded.empty();
+        if (decodeTable[0].isLeaf) return false;
 
-        // Traverse the tree to decode the string
         for (char bit : encoded) {
-            current = (bit == '0') ? current->left : current->right;
+            state = decodeTable[state].child[bit != '0'];
+            if (state < 0) return false;
+            if (!decodeTable[state].isLeaf) continue;
 
-            // When we reach a leaf node, append the character to the decoded string
-            if (!current->left && !current->right) {
-                decoded += current->Character;
-                current = root;
+            while (segment < segments.size() && offset == segments[segment].length) {
+                segment++;
+                offset = 0;
             }
+            if (segment == segments.size()) return false;
+
+            segments[segment].data[offset++] = decodeTable[state].Character;
+            written++;
+            state = 0;
         }
+        return true;
+    }
 
+    // Decode the encoded string back to the original string. A trailing
+    // incomplete code is ignored; bits the tree cannot decode give "".
+    string decode(string encoded) {
+        string decoded;
+        string packed = packBits(encoded);
+        packed.append(INPUT_PADDING, '\0');
+        if (!decodePacked((const uint8_t*)packed.data(), encoded.length(), decoded)) decoded.clear();
         return decoded;
     }
-};
 
-// Display the main menu for user interaction
-void MainMenu(){
-    cout << "\n\n--------------Welcome to Huffman Coding --------------\n\n";
-    cout << "1. Enter String and Encode/Decode\n";
-    cout << "2. Exit\n";
-    cout << "\nEnter your choice: ";
-}
+    // Hardened decoder for packed input (see packBits). The buffer must hold
+    // INPUT_PADDING readable bytes past its last byte. Every table index leads
+    // to an entry, and invalid prefixes map to INVALID entries that consume
+    // bits like any code, so the inner loop has no null checks and only one
+    // bounds check per code, while a worst-case code still fits in the input.
+    // A trailing incomplete code is ignored.
+    // Returns false if the bits contain a prefix the tree cannot decode.
+    bool decodePacked(const uint8_t* data, size_t bitCount, string& out) {
+        out.clear();
+        if (lookup.empty()) return bitCount == 0;
 
-// Validate if the user's choice is either 1 or 2
-bool isValidChoice(const string& choice) {
-    stringstream ss(choice);
-    int num;
-    ss >> num;
-    return !ss.fail() && ss.eof() && (num == 1 || num == 2);
-}
+        out.resize(outputBound(bitCount));
+        LookupLane lane = startLane(data, bitCount, &out[0]);
+        finishLane(lane);
+        out.resize(lane.out - &out[0]);
+        return !(lane.seen & INVALID);
+    }
 
-// Main function to execute the Huffman coding process
-int main() {
-    int choice;
-    string myString;
-    string encoded, decoded;
-    unordered_map<char, string> codes;
-    FrequencyTable table;
-    HuffmanTree hTree;
-    string inputChoice;
+    // The table walk of decodePacked without its hardening: exactly count
+    // codes are decoded with no end of input checks and no INVALID handling.
+    // The input must be valid, padded like for decodePacked, and come from a
+    // tree with two leaves or more. Only used to measure what the checks cost.
+    void decodePackedUnchecked(const uint8_t* data, size_t count, string& out) const {
+        out.resize(count);
+        LookupLane lane = startLane(data, 0, &out[0]);
+        for (size_t k = 0; k < count; k++) finishCode(lane, firstEntry(lane));
+    }
 
-    do {
-        MainMenu();  // Display the menu
-        getline(cin, inputChoice);  // Get user input for menu choice
+    // Append the shape of the tree in preorder: '0' for an internal node
+    // followed by its children, '1' and 8 bits for a leaf
+    void serialize(string& bits) { serializeNode(root, bits); }
+
+    // Replace the tree with one read by serialize(), advancing pos.
+    // Returns false if the bits do not describe a valid tree.
+    bool deserialize(const string& bits, size_t& pos) {
+        int leaves = 0;
+        destroy(root);
+        root = deserializeNode(bits, pos, 0, leaves);
+        decodeTable.clear();
+        buildDecodeTable(root);
+        buildLookup();
+        return root != nullptr;
+    }
+
+    // Decode exactly count characters starting at pos and append them to out.
+    // A tree with a single leaf uses no bits per character. Returns false if
+    // the bits run out or lead to a missing child.
+    bool decodeCount(const string& bits, size_t& pos, size_t count, string& out) {
+        if (decodeTable.empty()) return count == 0;
+        if (decodeTable[0].isLeaf) {
+            out.append(count, decodeTable[0].Character);
+            return true;
+        }
+
+        const DecodeEntry* table = decodeTable.data();
+        for (size_t n = 0; n < count; n++) {
+            int state = 0;
+            do {
+                if (pos >= bits.length()) return false;
+                state = table[state].child[bits[pos++] != '0'];
+                if (state < 0) return false;
+            } while (!table[state].isLeaf);
+            out += table[state].Character;
+        }
+        return true;
+    }
+
+    // Size in bytes of the flattened decode table used by the fast decoders
+    size_t getDecodeTableSize() { return decodeTable.size() * sizeof(DecodeEntry); }
+
+    // Decode several encoded strings produced by encode() in a single thread.
+    // Up to 'ways' (2-4) strings are decoded in the same loop through the
+    // lookup tables so that their table loads overlap. The result matches
+    // calling decode() on each one, including "" for undecodable bits.
+    vector<string> decodeInterleaved(const vector<string>& encoded, int ways = tuningProfile().decodeWays) {
+        vector<string> decoded(encoded.size());
+        if (lookup.empty()) return decoded;  // A single leaf has empty codes, as in decode()
+
+        string packed[4], output[4];
+        size_t i = 0;
+        if (ways >= 4) {
+            for (; i + 4 <= encoded.size(); i += 4) decodeGroup<4>(encoded, decoded, i, packed, output);
+        }
+        if (ways >= 3) {
+            for (; i + 3 <= encoded.size(); i += 3) decodeGroup<3>(encoded, decoded, i, packed, output);
+        }
+        if (ways >= 2) {
+            for (; i + 2 <= encoded.size(); i += 2) decodeGroup<2>(encoded, decoded, i, packed, output);
+        }
+        for (; i < encoded.size(); i++) decodeGroup<1>(encoded, decoded, i, packed, output);
+        return decoded;
+    }
+};
+
+// Compute the code length of every byte value from a histogram without
+// building tree nodes. The merge order is the one buildTree uses on a table
+// listed in byte order: leaves are indexed by byte value, merged nodes get
+// increasing indices after them, and DaryHeap breaks ties by index.
+// A single present character gets length 0, as in generateCodes().
+void buildCodeLengths(const uint32_t histogram[256], unsigned char lengths[256]) {
+    vector<DaryHeap<uint32_t>::Entry> leaves;
+    int parent[511];
+    int depth[511];
+
+    for (int c = 0; c < 256; c++) {
+        lengths[c] = 0;
+        if (histogram[c] > 0) leaves.push_back({histogram[c], c});
+    }
+    if (leaves.size() < 2) return;
+
+    DaryHeap<uint32_t> heap(leaves);
+    int next = 256;
+    while (heap.size() > 1) {
+        DaryHeap<uint32_t>::Entry a = heap.pop();
+        DaryHeap<uint32_t>::Entry b = heap.pop();
+        parent[a.index] = parent[b.index] = next;
+        heap.push(a.key + b.key, next++);
+    }
+
+    // Merged nodes are created after their children, so walk them backwards from the root
+    depth[next - 1] = 0;
+    for (int node = next - 2; node >= 256; node--) depth[node] = depth[parent[node]] + 1;
+    for (const DaryHeap<uint32_t>::Entry& leaf : leaves) {
+        lengths[leaf.index] = depth[parent[leaf.index]] + 1;
+    }
+}
+
+// Number of histograms handled together by buildCodeLengthsBatch
+const int BATCH_LANES = 16;
+
+// Merge step of the batch builder. Every lane runs the two-queue method on its
+// own sorted leaves: the next node is the smaller head of the leaf queue and
+// of the queue of merged nodes, a leaf winning ties exactly like in
+// buildCodeLengths. All lanes take one step per iteration; lanes that have
+// finished are masked off. Each kernel writes, per step and lane, the merged
+// count and the two nodes picked (a leaf row, or 256 + an earlier step).
+typedef void (*MergeKernel)(const uint32_t* sortedFreq, const int* symbols, uint32_t* mergedFreq,
+                            uint16_t* firstPick, uint16_t* secondPick, int steps);
+
+// Portable kernel: one lane after the other
+void mergeLanesScalar(const uint32_t* sortedFreq, const int* symbols, uint32_t* mergedFreq,
+                      uint16_t* firstPick, uint16_t* secondPick, int steps) {
+    const uint32_t none = UINT32_MAX;
+    int leafHead[BATCH_LANES] = {0};
+    int mergedHead[BATCH_LANES] = {0};
+
+    for (int s = 0; s < steps; s++) {
+        for (int lane = 0; lane < BATCH_LANES; lane++) {
+            int active = s + 1 < symbols[lane];
+            int leaf = leafHead[lane];
+            int merged = mergedHead[lane];
+
+            uint32_t leafFreq = sortedFreq[leaf * BATCH_LANES + lane];
+            uint32_t mergedFreq1 = merged < s ? mergedFreq[merged * BATCH_LANES + lane] : none;
+            int takeLeaf = leafFreq <= mergedFreq1;
+            uint32_t first = takeLeaf ? leafFreq : mergedFreq1;
+            uint16_t pick1 = takeLeaf ? leaf : 256 + merged;
+            leaf += takeLeaf;
+            merged += 1 - takeLeaf;
+
+            leafFreq = sortedFreq[leaf * BATCH_LANES + lane];
+            uint32_t mergedFreq2 = merged < s ? mergedFreq[merged * BATCH_LANES + lane] : none;
+            takeLeaf = leafFreq <= mergedFreq2;
+            uint32_t second = takeLeaf ? leafFreq : mergedFreq2;
+            uint16_t pick2 = takeLeaf ? leaf : 256 + merged;
+            leaf += takeLeaf;
+            merged += 1 - takeLeaf;
+
+            mergedFreq[s * BATCH_LANES + lane] = active ? first + second : none;
+            firstPick[s * BATCH_LANES + lane] = pick1;
+            secondPick[s * BATCH_LANES + lane] = pick2;
+            leafHead[lane] = active ? leaf : leafHead[lane];
+            mergedHead[lane] = active ? merged : mergedHead[lane];
+        }
+    }
+}
+
+#ifdef HUFFMAN_X86_KERNELS
+// AVX-512 kernel: the 16 lanes are the 16 elements of one register. Queue
+// heads are gathered, the smaller head is picked with an unsigned compare
+// mask, and finished lanes keep their heads through masked blends.
+__attribute__((target("avx512f")))
+void mergeLanesAvx512(const uint32_t* sortedFreq, const int* symbols, uint32_t* mergedFreq,
+                      uint16_t* firstPick, uint16_t* secondPick, int steps) {
+    const __mmask16 all = 0xFFFF;
+    const __m512i lane = _mm512_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15);
+    const __m512i one = _mm512_set1_epi32(1);
+    const __m512i none = _mm512_set1_epi32(-1);
+    const __m512i mergedBase = _mm512_set1_epi32(256);
+    const __m512i count = _mm512_loadu_si512(symbols);
+    __m512i leafHead = _mm512_setzero_si512();
+    __m512i mergedHead = _mm512_setzero_si512();
+
+    for (int s = 0; s < steps; s++) {
+        __mmask16 active = _mm512_cmplt_epi32_mask(_mm512_set1_epi32(s + 1), count);
+        __m512i step = _mm512_set1_epi32(s);
+        __m512i leaf = leafHead, merged = mergedHead;
+        __m512i picked[2], pick[2];
+
+        for (int k = 0; k < 2; k++) {
+            __m512i leafFreq = _mm512_mask_i32gather_epi32(none, all, _mm512_add_epi32(_mm512_maskz_slli_epi32(all, leaf, 4), lane),
+                                                           (const int*)sortedFreq, 4);
+            __mmask16 built = _mm512_cmplt_epi32_mask(merged, step);
+            __m512i nodeFreq = _mm512_mask_i32gather_epi32(none, built, _mm512_add_epi32(_mm512_maskz_slli_epi32(all, merged, 4), lane),
+                                                           (const int*)mergedFreq, 4);
+            __mmask16 takeLeaf = _mm512_cmple_epu32_mask(leafFreq, nodeFreq);
+            picked[k] = _mm512_mask_blend_epi32(takeLeaf, nodeFreq, leafFreq);
+            pick[k] = _mm512_mask_blend_epi32(takeLeaf, _mm512_add_epi32(merged, mergedBase), leaf);
+            leaf = _mm512_mask_add_epi32(leaf, takeLeaf, leaf, one);
+            merged = _mm512_mask_add_epi32(merged, (__mmask16)~takeLeaf, merged, one);
+        }
+
+        _mm512_storeu_si512(mergedFreq + s * BATCH_LANES,
+                            _mm512_mask_blend_epi32(active, none, _mm512_add_epi32(picked[0], picked[1])));
+        _mm256_storeu_si256((__m256i*)(firstPick + s * BATCH_LANES), _mm512_maskz_cvtepi32_epi16(all, pick[0]));
+        _mm256_storeu_si256((__m256i*)(secondPick + s * BATCH_LANES), _mm512_maskz_cvtepi32_epi16(all, pick[1]));
+        leafHead = _mm512_mask_blend_epi32(active, leafHead, leaf);
+        mergedHead = _mm512_mask_blend_epi32(active, mergedHead, merged);
+    }
+}
+
+// AVX2 kernel: the 16 lanes are two registers of 8. AVX2 has no unsigned
+// compare, so a <= b is tested as max(a, b) == b, and compare results are
+// all-ones lanes that are subtracted to advance the queue heads.
+__attribute__((target("avx2")))
+void mergeLanesAvx2(const uint32_t* sortedFreq, const int* symbols, uint32_t* mergedFreq,
+                    uint16_t* firstPick, uint16_t* secondPick, int steps) {
+    const __m256i none = _mm256_set1_epi32(-1);
+    const __m256i one = _mm256_set1_epi32(1);
+    const __m256i mergedBase = _mm256_set1_epi32(256);
+    __m256i lane[2], count[2], leafHead[2], mergedHead[2];
+    for (int h = 0; h < 2; h++) {
+        lane[h] = _mm256_setr_epi32(8 * h, 8 * h + 1, 8 * h + 2, 8 * h + 3, 8 * h + 4, 8 * h + 5, 8 * h + 6, 8 * h + 7);
+        count[h] = _mm256_loadu_si256((const __m256i*)(symbols + 8 * h));
+        leafHead[h] = _mm256_setzero_si256();
+        mergedHead[h] = _mm256_setzero_si256();
+    }
+
+    for (int s = 0; s < steps; s++) {
+        __m256i step = _mm256_set1_epi32(s);
+        __m256i next = _mm256_set1_epi32(s + 1);
+        __m256i sum[2], pick[2][2];
+        __m256i active[2];
+        for (int h = 0; h < 2; h++) {
+            active[h] = _mm256_cmpgt_epi32(count[h], next);
+            __m256i leaf = leafHead[h], merged = mergedHead[h];
+            __m256i picked[2];
+            for (int k = 0; k < 2; k++) {
+                __m256i leafFreq = _mm256_i32gather_epi32((const int*)sortedFreq,
+                                                          _mm256_add_epi32(_mm256_slli_epi32(leaf, 4), lane[h]), 4);
+                __m256i built = _mm256_cmpgt_epi32(step, merged);
+                __m256i nodeFreq = _mm256_mask_i32gather_epi32(none, (const int*)mergedFreq,
+                                                               _mm256_add_epi32(_mm256_slli_epi32(merged, 4), lane[h]), built, 4);
+                __m256i takeLeaf = _mm256_cmpeq_epi32(_mm256_max_epu32(leafFreq, nodeFreq), nodeFreq);
+                picked[k] = _mm256_blendv_epi8(nodeFreq, leafFreq, takeLeaf);
+                pick[k][h] = _mm256_blendv_epi8(_mm256_add_epi32(merged, mergedBase), leaf, takeLeaf);
+                leaf = _mm256_sub_epi32(leaf, takeLeaf);
+                merged = _mm256_add_epi32(merged, _mm256_add_epi32(one, takeLeaf));
+            }
+            sum[h] = _mm256_blendv_epi8(none, _mm256_add_epi32(picked[0], picked[1]), active[h]);
+            leafHead[h] = _mm256_blendv_epi8(leafHead[h], leaf, active[h]);
+            mergedHead[h] = _mm256_blendv_epi8(mergedHead[h], merged, active[h]);
+        }
+
+        _mm256_storeu_si256((__m256i*)(mergedFreq + s * BATCH_LANES), sum[0]);
+        _mm256_storeu_si256((__m256i*)(mergedFreq + s * BATCH_LANES + 8), sum[1]);
+        // Picks are below 512, so packing to 16 bits is exact; the permute
+        // undoes the per-128-bit interleaving of the pack
+        uint16_t* picks[2] = {firstPick + s * BATCH_LANES, secondPick + s * BATCH_LANES};
+        for (int k = 0; k < 2; k++) {
+            __m256i packed = _mm256_permute4x64_epi64(_mm256_packus_epi32(pick[k][0], pick[k][1]), 0xD8);
+            _mm256_storeu_si256((__m256i*)picks[k], packed);
+        }
+    }
+}
+#endif
+
+// Merge kernels this CPU can run, fastest first
+vector<pair<string, MergeKernel>> availableMergeKernels() {
+    vector<pair<string, MergeKernel>> kernels;
+#ifdef HUFFMAN_X86_KERNELS
+    if (__builtin_cpu_supports("avx512f")) kernels.push_back(make_pair(string("avx512"), mergeLanesAvx512));
+    if (__builtin_cpu_supports("avx2")) kernels.push_back(make_pair(string("avx2"), mergeLanesAvx2));
+#endif
+    kernels.push_back(make_pair(string("scalar"), mergeLanesScalar));
+    return kernels;
+}
+
+// Widest merge kernel this CPU runs, looked up once
+MergeKernel defaultMergeKernel() {
+    static const MergeKernel kernel = availableMergeKernels().front().second;
+    return kernel;
+}
+
+// Compute code lengths for many histograms, BATCH_LANES at a time: each lane
+// sorts its symbols, then the merge kernel runs all lanes together. lengths[i]
+// equals buildCodeLengths() of histograms[i], whose counts sum to under 2^32.
+void buildCodeLengthsBatch(const vector<const uint32_t*>& histograms, vector<array<unsigned char, 256>>& lengths,
+                           MergeKernel merge = defaultMergeKernel()) {
+    const int rows = 258;  // 256 leaves plus sentinel rows read by finished lanes
+    vector<uint32_t> sortedFreq(rows * BATCH_LANES);
+    vector<unsigned char> sortedSymbol(rows * BATCH_LANES);
+    vector<uint32_t> mergedFreq(256 * BATCH_LANES);
+    vector<uint16_t> firstPick(256 * BATCH_LANES), secondPick(256 * BATCH_LANES);
+    vector<pair<uint32_t, int>> present;
+    unsigned char depth[256];
+
+    lengths.assign(histograms.size(), array<unsigned char, 256>());
+
+    for (size_t group = 0; group < histograms.size(); group += BATCH_LANES) {
+        int symbols[BATCH_LANES];
+        int steps = 0;
+        fill(sortedFreq.begin(), sortedFreq.end(), UINT32_MAX);
+
+        // Sort the present symbols of every lane by (count, byte value)
+        for (int lane = 0; lane < BATCH_LANES; lane++) {
+            present.clear();
+            if (group + lane < histograms.size()) {
+                const uint32_t* histogram = histograms[group + lane];
+                for (int c = 0; c < 256; c++) {
+                    if (histogram[c] > 0) present.push_back(make_pair(histogram[c], c));
+                }
+                sort(present.begin(), present.end());
+            }
+            symbols[lane] = present.size();
+            steps = max(steps, symbols[lane] - 1);
+            for (size_t i = 0; i < present.size(); i++) {
+                sortedFreq[i * BATCH_LANES + lane] = present[i].first;
+                sortedSymbol[i * BATCH_LANES + lane] = present[i].second;
+            }
+        }
+
+        merge(sortedFreq.data(), symbols, mergedFreq.data(), firstPick.data(), secondPick.data(), steps);
+
+        // Walk the merges from the root down to assign depths
+        for (int lane = 0; lane < BATCH_LANES && group + lane < histograms.size(); lane++) {
+            array<unsigned char, 256>& out = lengths[group + lane];
+            out.fill(0);
+            if (symbols[lane] < 2) continue;
+
+            int root = symbols[lane] - 2;
+            depth[root] = 0;
+            for (int s = root; s >= 0; s--) {
+                uint16_t picks[2] = {firstPick[s * BATCH_LANES + lane], secondPick[s * BATCH_LANES + lane]};
+                for (uint16_t pick : picks) {
+                    if (pick >= 256) depth[pick - 256] = depth[s] + 1;
+                    else out[sortedSymbol[pick * BATCH_LANES + lane]] = depth[s] + 1;
+                }
+            }
+        }
+    }
+}
+
+// Append the lowest 'count' bits of value to a bit string, most significant bit first
+void appendBits(string& bits, unsigned long value, int count) {
+    for (int i = count - 1; i >= 0; i--) {
+        bits += ((value >> i) & 1) ? '1' : '0';
+    }
+}
+
+// Read 'count' bits from a bit string starting at pos and advance pos
+unsigned long readBits(const string& bits, size_t& pos, int count) {
+    unsigned long value = 0;
+    for (int i = 0; i < count && pos < bits.length(); i++) {
+        value = (value << 1) | (bits[pos++] == '1');
+    }
+    return value;
+}
+
+// Append a value as a varint: 7 bits per byte, low bits first, high bit set on all but the last
+void appendVarint(string& bytes, size_t value) {
+    while (value >= 0x80) {
+        bytes += (char)(0x80 | (value & 0x7F));
+        value >>= 7;
+    }
+    bytes += (char)value;
+}
+
+// Read a varint written by appendVarint(); false if it runs past the end or is too long
+bool readVarint(const string& bytes, size_t& pos, size_t& value) {
+    value = 0;
+    for (int shift = 0; shift < 64; shift += 7) {
+        if (pos >= bytes.length()) return false;
+        unsigned char b = bytes[pos++];
+        value |= (size_t)(b & 0x7F) << shift;
+        if (!(b & 0x80)) return true;
+    }
+    return false;
+}
+
+// BitWriter packs bits most significant first into a caller buffer
+struct BitWriter {
+    uint8_t* out;  // Destination buffer, large enough for everything written
+    size_t bytes;  // Whole bytes written so far
+    uint64_t pending;  // Bits not yet written, in the low 'count' bits
+    int count;
+
+    explicit BitWriter(uint8_t* out) : out(out), bytes(0), pending(0), count(0) {}
+
+    // Write the lowest 'bits' bits of value, at most 32
+    void put(uint32_t value, int bits) {
+        pending = (pending << bits) | value;
+        count += bits;
+        while (count >= 8) {
+            count -= 8;
+            out[bytes++] = (uint8_t)(pending >> count);
+        }
+    }
+
+    // Pad the last byte with zeros and return the number of bytes written
+    size_t finish() {
+        if (count > 0) put(0, 8 - count);
+        return bytes;
+    }
+};
+
+// BitReader reads bits written by BitWriter. Reading past the end yields zeros
+// and sets overrun, so callers only check once at the end.
+struct BitReader {
+    const uint8_t* in;
+    size_t size;  // Size of the buffer in bytes
+    size_t pos;  // Position in bits
+    bool overrun;  // Set once a read went past the end
+
+    BitReader(const uint8_t* in, size_t size) : in(in), size(size), pos(0), overrun(false) {}
+
+    uint32_t bit() {
+        if (pos >= size * 8) {
+            overrun = true;
+            return 0;
+        }
+        uint32_t value = (in[pos >> 3] >> (7 - (pos & 7))) & 1;
+        pos++;
+        return value;
+    }
+
+    uint32_t get(int bits) {
+        uint32_t value = 0;
+        for (int i = 0; i < bits; i++) value = (value << 1) | bit();
+        return value;
+    }
+};
+
+// WorkloadCapture samples payloads passed to the public encode entry points
+// into a corpus file, so benchmarks can replay real traffic. The file starts
+// with MAGIC, and each record holds the name of the entry point and the payload,
+// each as a varint length and bytes. A call is sampled when a hash of its
+// sequence number falls below the fraction, so threads never share a random
+// generator. With scrambling, letters, digits, control bytes and UTF-8 bytes
+// are replaced through a random permutation within their class, drawn once per
+// capture. Whitespace, punctuation and zeros are kept. The byte histogram is
+// kept too, so Huffman ratios replay exactly. This hides text from casual
+// reading but is a substitution, not encryption.
+class WorkloadCapture {
+public:
+    static constexpr const char* MAGIC = "HUFFCAP1";
+
+private:
+    mutex lock;  // Serializes writes to the file
+    ofstream out;
+    atomic<bool> enabled;
+    atomic<uint64_t> calls;  // Entry point calls seen while enabled
+    double fraction;  // Share of calls sampled
+    bool scramble;
+    unsigned char substitute[256];  // Byte written for each input byte
+    size_t limitBytes;  // Capture stops once the file would grow past this
+    size_t writtenBytes;
+    size_t records;
+
+    // Build the permutation of every byte class for one capture
+    void drawSubstitution() {
+        vector<vector<unsigned char>> classes(6);
+        for (int b = 0; b < 256; b++) {
+            substitute[b] = (unsigned char)b;
+            if (b >= '0' && b <= '9') classes[0].push_back(b);
+            else if (b >= 'A' && b <= 'Z') classes[1].push_back(b);
+            else if (b >= 'a' && b <= 'z') classes[2].push_back(b);
+            else if ((b > 0 && b < 32 && b != '\t' && b != '\n' && b != '\r') || b == 127) classes[3].push_back(b);
+            else if (b >= 0x80 && b < 0xC0) classes[4].push_back(b);
+            else if (b >= 0xC0) classes[5].push_back(b);
+        }
+        random_device seed;
+        mt19937 rng(seed());
+        for (const vector<unsigned char>& members : classes) {
+            vector<unsigned char> shuffled(members);
+            shuffle(shuffled.begin(), shuffled.end(), rng);
+            for (size_t i = 0; i < members.size(); i++) substitute[members[i]] = shuffled[i];
+        }
+    }
+
+public:
+    WorkloadCapture() : enabled(false), calls(0), fraction(0), scramble(false), limitBytes(0), writtenBytes(0), records(0) {}
+
+    // Start sampling into a new file at path. Returns false if it cannot be written.
+    bool start(const string& path, double fraction, bool scramble, size_t limitBytes) {
+        lock_guard<mutex> guard(lock);
+        if (out.is_open()) out.close();
+        out.open(path, ios::binary | ios::trunc);
+        if (!out) return false;
+        out.write(MAGIC, strlen(MAGIC));
+        this->fraction = min(max(fraction, 0.0), 1.0);
+        this->scramble = scramble;
+        this->limitBytes = limitBytes;
+        writtenBytes = strlen(MAGIC);
+        records = 0;
+        if (scramble) drawSubstitution();
+        calls.store(0, memory_order_relaxed);
+        enabled.store(true, memory_order_release);
+        return true;
+    }
+
+    // Stop sampling and close the file
+    void stop() {
+        lock_guard<mutex> guard(lock);
+        enabled.store(false, memory_order_release);
+        if (out.is_open()) out.close();
+    }
+
+    bool isEnabled() const { return enabled.load(memory_order_relaxed); }
+    size_t getRecords() { lock_guard<mutex> guard(lock); return records; }
+
+    // Offer a payload seen by the named entry point. Costs one load while disabled.
+    void record(const char* source, const char* data, size_t n) {
+        if (!enabled.load(memory_order_relaxed)) return;
+
+        // splitmix64 of the call number, as a uniform value in [0, 1)
+        uint64_t z = calls.fetch_add(1, memory_order_relaxed) + 0x9E3779B97F4A7C15ULL;
+        z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+        z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+        z ^= z >> 31;
+        if ((z >> 11) * 0x1p-53 >= fraction) return;
+
+        string entry;
+        size_t sourceLength = strlen(source);
+        appendVarint(entry, sourceLength);
+        entry.append(source, sourceLength);
+        appendVarint(entry, n);
+        size_t header = entry.length();
+        entry.append(data, n);
+        if (scramble) {
+            for (size_t i = header; i < entry.length(); i++) entry[i] = (char)substitute[(unsigned char)entry[i]];
+        }
+
+        lock_guard<mutex> guard(lock);
+        if (!enabled.load(memory_order_relaxed)) return;
+        if (writtenBytes + entry.length() > limitBytes) {
+            enabled.store(false, memory_order_relaxed);
+            out.flush();
+            return;
+        }
+        out.write(entry.data(), entry.length());
+        writtenBytes += entry.length();
+        records++;
+    }
+
+    void record(const char* source, const string& data) { record(source, data.data(), data.length()); }
+
+    // Read the records of a capture file as (entry point, payload) pairs.
+    // Returns false if the file is not a complete capture.
+    static bool load(const string& path, vector<pair<string, string>>& payloads) {
+        payloads.clear();
+        ifstream in(path, ios::binary);
+        string bytes((istreambuf_iterator<char>(in)), istreambuf_iterator<char>());
+        size_t magicLength = strlen(MAGIC);
+        if (bytes.compare(0, magicLength, MAGIC) != 0) return false;
+
+        size_t pos = magicLength, length;
+        while (pos < bytes.length()) {
+            pair<string, string> payload;
+            if (!readVarint(bytes, pos, length) || length > bytes.length() - pos) return false;
+            payload.first = bytes.substr(pos, length);
+            pos += length;
+            if (!readVarint(bytes, pos, length) || length > bytes.length() - pos) return false;
+            payload.second = bytes.substr(pos, length);
+            pos += length;
+            payloads.push_back(payload);
+        }
+        return true;
+    }
+};
+
+// The capture every encode entry point reports to, off until started
+WorkloadCapture& workloadCapture() {
+    static WorkloadCapture capture;
+    return capture;
+}
+
+// Start a capture if HUFFMAN_CAPTURE names a file. HUFFMAN_CAPTURE_RATE is the
+// share of calls sampled (default 0.01), HUFFMAN_CAPTURE_SCRAMBLE=0 keeps bytes
+// as they are, and HUFFMAN_CAPTURE_LIMIT_MB caps the file (default 256).
+void startCaptureFromEnvironment() {
+    const char* path = getenv("HUFFMAN_CAPTURE");
+    if (!path || !*path) return;
+    const char* rate = getenv("HUFFMAN_CAPTURE_RATE");
+    const char* scramble = getenv("HUFFMAN_CAPTURE_SCRAMBLE");
+    const char* limit = getenv("HUFFMAN_CAPTURE_LIMIT_MB");
+    double fraction = rate ? atof(rate) : 0.01;
+    size_t megabytes = limit ? strtoull(limit, nullptr, 10) : 256;
+    if (!workloadCapture().start(path, fraction, !scramble || strcmp(scramble, "0") != 0, megabytes << 20)) {
+        cout << "\nError! Could not write capture file " << path << endl;
+    }
+}
+
+// CodeTable is a trained codebook: a Huffman tree built once from a training
+// corpus, the codes generated from it and the ID it is published under.
+class CodeTable {
+private:
+    int id;  // ID written in front of every message encoded with this table
+    HuffmanTree tree;  // Tree used to decode messages
+    string code[256];  // Code of each byte value, indexed by unsigned char
+
+public:
+    // Build the codebook from a frequency table
+    CodeTable(int id, FrequencyTable& table) {
+        this->id = id;
+        tree.buildTree(table);
+
+        unordered_map<char, string> codes = tree.generateCodes();
+        for (const pair<const char, string>& p : codes) {
+            code[(unsigned char)p.first] = p.second;
+        }
+    }
+
+    int getId() { return id; }
+    HuffmanTree& getTree() { return tree; }
+
+    // Length in bits of the code of a character, 0 if it has no code
+    int codeLength(char c) { return code[(unsigned char)c].length(); }
+
+    // Code of a character, empty if it has no code
+    const string& codeOf(char c) { return code[(unsigned char)c]; }
+
+    // Number of bits the input takes when encoded with this table
+    size_t encodedBits(const string& input) {
+        size_t bits = 0;
+        for (char c : input) bits += code[(unsigned char)c].length();
+        return bits;
+    }
+
+    // Encode the input string with the trained codes
+    string encode(const string& input) {
+        string encoded;
+        encoded.reserve(encodedBits(input));
+        for (char c : input) encoded += code[(unsigned char)c];
+        return encoded;
+    }
+
+    // Decode a string produced by encode()
+    string decode(const string& encoded) { return tree.decode(encoded); }
+
+    // Train a codebook on sample payloads. Every byte value gets a count of at
+    // least one, so the table can encode characters missing from the samples.
+    static CodeTable* train(int id, const vector<string>& samples) {
+        int counts[256];
+
+        fill(counts, counts + 256, 0);
+        for (const string& sample : samples) {
+            for (char c : sample) counts[(unsigned char)c]++;
+        }
+        return fromCounts(id, counts);
+    }
+
+    // Build a codebook from per-byte counts, adding one to every count.
+    // The same counts always give the same codes, so counts can be saved instead of trees.
+    static CodeTable* fromCounts(int id, const int counts[256]) {
+        FrequencyTable table;
+        for (int c = 0; c < 256; c++) {
+            table.AddFrequency((char)c, counts[c] + 1);
+        }
+        return new CodeTable(id, table);
+    }
+};
+
+// EpochManager implements epoch-based reclamation for objects shared with
+// readers that never take a lock. A reader pins the current epoch in its own
+// slot with a plain store; a writer that unlinks an object retires it with the
+// epoch it was unlinked in, and the object is freed once every pinned reader
+// has moved past that epoch.
+class EpochManager {
+private:
+    static constexpr int MAX_READERS = 256;  // Number of reader slots
+
+    // Each slot sits on its own cache line so readers never share one
+    struct alignas(64) ReaderSlot {
+        atomic<uint64_t> epoch;  // Pinned epoch, 0 when the reader is outside a critical section
+        atomic<bool> used;  // True while a thread owns the slot
+    };
+
+    // An object waiting until no reader can still see it
+    struct Retired {
+        void* object;
+        void (*deleter)(void*);
+        uint64_t epoch;  // Epoch in which the object was unlinked
+    };
+
+    // Releases the slot of a thread when the thread exits
+    struct SlotOwner {
+        int slot = -1;
+        int depth = 0;  // Nesting depth of EpochGuards on this thread
+        ~SlotOwner() {
+            if (slot >= 0) EpochManager::global().slots[slot].used.store(false, memory_order_release);
+        }
+    };
+
+    ReaderSlot slots[MAX_READERS];
+    atomic<uint64_t> globalEpoch;  // Advanced by writers after every retire
+    mutex retireLock;  // Serializes writers on the retired list
+    vector<Retired> retired;  // Objects waiting to be freed
+
+    EpochManager() : globalEpoch(1) {
+        for (ReaderSlot& slot : slots) {
+            slot.epoch.store(0);
+            slot.used.store(false);
+        }
+    }
+
+    // Slot of the calling thread, claimed on its first pin
+    SlotOwner& myOwner() {
+        static thread_local SlotOwner owner;
+        if (owner.slot < 0) {
+            for (int i = 0; i < MAX_READERS; i++) {
+                bool expected = false;
+                if (!slots[i].used.load(memory_order_relaxed) &&
+                    slots[i].used.compare_exchange_strong(expected, true)) {
+                    owner.slot = i;
+                    break;
+                }
+            }
+            if (owner.slot < 0) {
+                cerr << "EpochManager: more than " << MAX_READERS << " reader threads" << endl;
+                abort();
+            }
+        }
+        return owner;
+    }
+
+    // Smallest epoch pinned by any reader, UINT64_MAX if no reader is pinned
+    uint64_t minPinnedEpoch() {
+        uint64_t minimum = UINT64_MAX;
+        for (ReaderSlot& slot : slots) {
+            uint64_t epoch = slot.epoch.load(memory_order_seq_cst);
+            if (epoch != 0) minimum = min(minimum, epoch);
+        }
+        return minimum;
+    }
+
+public:
+    // All shared codebooks use one process-wide manager
+    static EpochManager& global() {
+        static EpochManager manager;
+        return manager;
+    }
+
+    // Enter a read-side critical section. Only plain loads, a plain store and a
+    // fence are used: no read-modify-write touches a shared cache line.
+    // Nested pins on the same thread keep the outermost epoch.
+    void pin() {
+        SlotOwner& owner = myOwner();
+        if (owner.depth++ > 0) return;
+        slots[owner.slot].epoch.store(globalEpoch.load(memory_order_relaxed), memory_order_relaxed);
+        atomic_thread_fence(memory_order_seq_cst);
+    }
+
+    // Leave the read-side critical section
+    void unpin() {
+        SlotOwner& owner = myOwner();
+        if (--owner.depth > 0) return;
+        slots[owner.slot].epoch.store(0, memory_order_release);
+    }
+
+    // Hand over an object that has already been unlinked from every shared pointer
+    template <typename T>
+    void retire(T* object) {
+        if (!object) return;
+        lock_guard<mutex> guard(retireLock);
+        retired.push_back({object, [](void* p) { delete static_cast<T*>(p); },
+                           globalEpoch.fetch_add(1, memory_order_seq_cst)});
+    }
+
+    // Free the retired objects that no pinned reader can still reach.
+    // Returns the number of objects freed.
+    size_t reclaim() {
+        lock_guard<mutex> guard(retireLock);
+        uint64_t safe = minPinnedEpoch();
+        size_t kept = 0;
+        size_t freed = 0;
+
+        for (size_t i = 0; i < retired.size(); i++) {
+            if (retired[i].epoch < safe) {
+                retired[i].deleter(retired[i].object);
+                freed++;
+            } else {
+                retired[kept++] = retired[i];
+            }
+        }
+        retired.resize(kept);
+        return freed;
+    }
+
+    // Number of retired objects still waiting to be freed
+    size_t pendingCount() {
+        lock_guard<mutex> guard(retireLock);
+        return retired.size();
+    }
+};
+
+// EpochGuard pins the epoch for the lifetime of a scope
+class EpochGuard {
+public:
+    EpochGuard() { EpochManager::global().pin(); }
+    ~EpochGuard() { EpochManager::global().unpin(); }
+    EpochGuard(const EpochGuard&) = delete;
+    EpochGuard& operator=(const EpochGuard&) = delete;
+};
+
+// CodebookRegistry keeps every published codebook so that messages encoded
+// with an old ID stay decodable after a newer codebook becomes current.
+// Encoders and decoders never take a lock: the current codebook and the ID
+// index are swapped atomically by writers, and replaced objects are freed
+// through the EpochManager once no reader can still see them.
+class CodebookRegistry {
+private:
+    typedef vector<CodeTable*> TableIndex;  // Codebooks by ID, nullptr once retired
+
+    mutex writeLock;  // Serializes publish() and retire()
+    atomic<CodeTable*> current;  // Codebook used by encode()
+    atomic<TableIndex*> index;  // Immutable snapshot, replaced on every change
+
+    // Replace the index snapshot, retiring the old one
+    void swapIndex(TableIndex* next) {
+        EpochManager::global().retire(index.exchange(next, memory_order_acq_rel));
+    }
+
+public:
+    static constexpr int ID_BITS = 16;  // Width of the ID header in front of each message
+
+    CodebookRegistry() : current(nullptr), index(new TableIndex()) {}
+
+    // Destructor frees every codebook still held by the registry.
+    // No reader may be using the registry any more.
+    ~CodebookRegistry() {
+        TableIndex* tables = index.load();
+        for (CodeTable* table : *tables) delete table;
+        delete tables;
+        EpochManager::global().reclaim();
+    }
+
+    CodebookRegistry(const CodebookRegistry&) = delete;
+    CodebookRegistry& operator=(const CodebookRegistry&) = delete;
+
+    // Train a codebook on the samples, publish it under a new ID and make it current
+    int publish(const vector<string>& samples) {
+        lock_guard<mutex> guard(writeLock);
+        TableIndex* tables = index.load(memory_order_acquire);
+        int id = tables->size();
+
+        if (id >= (1 << ID_BITS)) return -1;
+
+        // Readers keep using the previous snapshot while the new one is built
+        CodeTable* table = CodeTable::train(id, samples);
+        TableIndex* next = new TableIndex(*tables);
+        next->push_back(table);
+
+        swapIndex(next);
+        current.store(table, memory_order_release);
+        EpochManager::global().reclaim();
+        return id;
+    }
+
+    // Drop an old codebook. Messages that use its ID can no longer be decoded,
+    // and the table is freed once no reader is still decoding with it.
+    bool retire(int id) {
+        lock_guard<mutex> guard(writeLock);
+        TableIndex* tables = index.load(memory_order_acquire);
+
+        if (id < 0 || id >= (int)tables->size() || !(*tables)[id]) return false;
+        if ((*tables)[id] == current.load(memory_order_relaxed)) return false;
+
+        CodeTable* table = (*tables)[id];
+        TableIndex* next = new TableIndex(*tables);
+        (*next)[id] = nullptr;
+
+        swapIndex(next);
+        EpochManager::global().retire(table);
+        EpochManager::global().reclaim();
+        return true;
+    }
+
+    int getCurrentId() {
+        EpochGuard guard;
+        CodeTable* table = current.load(memory_order_acquire);
+        return table ? table->getId() : -1;
+    }
+
+    // Look up a published codebook, nullptr if the ID is unknown or retired.
+    // The caller must hold an EpochGuard for as long as it uses the table.
+    CodeTable* get(int id) {
+        TableIndex* tables = index.load(memory_order_acquire);
+        return (id >= 0 && id < (int)tables->size()) ? (*tables)[id] : nullptr;
+    }
+
+    // Encode a message with the current codebook, prefixed by its ID
+    string encode(const string& input) {
+        workloadCapture().record("registry", input);
+        EpochGuard guard;
+        CodeTable* table = current.load(memory_order_acquire);
+        if (!table) return "";
+
+        string encoded;
+        appendBits(encoded, table->getId(), ID_BITS);
+        return encoded + table->encode(input);
+    }
+
+    // Decode a message with the codebook named by its ID header
+    string decode(const string& encoded) {
+        EpochGuard guard;
+        size_t pos = 0;
+        CodeTable* table = get(readBits(encoded, pos, ID_BITS));
+        if (!table) return "";
+        return table->decode(encoded.substr(pos));
+    }
+};
+
+// DriftMonitor samples payloads and compares the bits spent by the current
+// codebook with the optimum of a fresh FrequencyTable built on the same
+// samples. When the gap exceeds the threshold, a low-priority background
+// thread retrains a codebook and publishes it under a new ID.
+class DriftMonitor {
+private:
+    CodebookRegistry& registry;  // Registry the retrained codebooks are published to
+    int sampleEvery;  // Keep one payload out of every sampleEvery
+    double threshold;  // Relative gap (realized / optimum - 1) that triggers retraining
+    size_t windowSize;  // Number of most recent samples kept for comparison
+    size_t checkEvery;  // Number of new samples between two drift checks
+
+    mutex lock;  // Guards the window and the worker state
+    condition_variable wake;  // Wakes the worker when enough samples arrived
+    deque<string> window;  // Most recent sampled payloads
+    size_t pendingSamples;  // Samples added since the last check
+    bool stopping;  // Set by the destructor to stop the worker
+
+    atomic<unsigned long> seen;  // Payloads observed so far
+    atomic<int> retrainCount;  // Codebooks published by the monitor
+    double lastGap;  // Gap measured by the last check
+    thread worker;  // Background thread doing the checks and retraining
+
+    // Lower the priority of the calling thread so retraining never competes with encoders
+    static void lowerPriority() {
+#ifdef __linux__
+        setpriority(PRIO_PROCESS, syscall(SYS_gettid), 19);
+#endif
+    }
+
+    // Measure the drift of the current codebook on the given samples
+    double measureGap(const vector<string>& samples) {
+        EpochGuard epoch;
+        CodeTable* current = registry.get(registry.getCurrentId());
+        FrequencyTable fresh;
+        HuffmanTree optimum;
+        int counts[256] = {0};
+        unsigned long long realized = 0;
+        unsigned long long optimal = 0;
+
+        if (!current) return 0.0;
+
+        for (const string& sample : samples) {
+            for (char c : sample) counts[(unsigned char)c]++;
+        }
+        for (int c = 0; c < 256; c++) {
+            if (counts[c] > 0) fresh.AddFrequency((char)c, counts[c]);
+        }
+        if (fresh.isEmpty()) return 0.0;
+
+        optimum.buildTree(fresh);
+        unordered_map<char, string> codes = optimum.generateCodes();
+        for (int c = 0; c < 256; c++) {
+            if (counts[c] == 0) continue;
+            realized += (unsigned long long)counts[c] * current->codeLength((char)c);
+            optimal += (unsigned long long)counts[c] * max<size_t>(codes[(char)c].length(), 1);
+        }
+        return (double)realized / optimal - 1.0;
+    }
+
+    // Worker loop: wait for samples, check the drift and retrain when needed
+    void run() {
+        lowerPriority();
+
+        unique_lock<mutex> guard(lock);
+        while (true) {
+            wake.wait(guard, [this] { return stopping || pendingSamples >= checkEvery; });
+            if (stopping) return;
+
+            vector<string> samples(window.begin(), window.end());
+            pendingSamples = 0;
+            guard.unlock();
+
+            double gap = measureGap(samples);
+            if (gap > threshold) {
+                registry.publish(samples);
+                retrainCount++;
+            }
+
+            guard.lock();
+            lastGap = gap;
+        }
+    }
+
+public:
+    // Start monitoring; the registry should already hold a current codebook
+    DriftMonitor(CodebookRegistry& registry, int sampleEvery = 16, double threshold = 0.05,
+                 size_t windowSize = 256, size_t checkEvery = 64)
+        : registry(registry), sampleEvery(sampleEvery), threshold(threshold),
+          windowSize(windowSize), checkEvery(checkEvery), pendingSamples(0), stopping(false),
+          seen(0), retrainCount(0), lastGap(0.0) {
+        worker = thread(&DriftMonitor::run, this);
+    }
+
+    // Destructor stops the worker thread
+    ~DriftMonitor() {
+        {
+            lock_guard<mutex> guard(lock);
+            stopping = true;
+        }
+        wake.notify_one();
+        worker.join();
+    }
+
+    DriftMonitor(const DriftMonitor&) = delete;
+    DriftMonitor& operator=(const DriftMonitor&) = delete;
+
+    // Offer a payload to the monitor; only one out of every sampleEvery is kept
+    void observe(const string& payload) {
+        if (seen++ % sampleEvery != 0) return;
+
+        bool ready;
+        {
+            lock_guard<mutex> guard(lock);
+            window.push_back(payload);
+            if (window.size() > windowSize) window.pop_front();
+            ready = ++pendingSamples >= checkEvery;
+        }
+        if (ready) wake.notify_one();
+    }
+
+    double getLastGap() {
+        lock_guard<mutex> guard(lock);
+        return lastGap;
+    }
+
+    int getRetrainCount() { return retrainCount; }
+};
+
+// Cost in bits of a histogram under a table of code lengths: the dot product
+// of two 256-entry arrays. The AVX2 version multiplies eight counts at a time.
+typedef unsigned long long (*CostKernel)(const uint32_t* histogram, const uint32_t* lengths);
+
+unsigned long long costScalar(const uint32_t* histogram, const uint32_t* lengths) {
+    unsigned long long total = 0;
+    for (int c = 0; c < 256; c++) total += (unsigned long long)histogram[c] * lengths[c];
+    return total;
+}
+
+#ifdef HUFFMAN_X86_KERNELS
+__attribute__((target("avx2")))
+unsigned long long costAvx2(const uint32_t* histogram, const uint32_t* lengths) {
+    __m256i sum = _mm256_setzero_si256();
+    for (int c = 0; c < 256; c += 8) {
+        __m256i h = _mm256_loadu_si256((const __m256i*)(histogram + c));
+        __m256i l = _mm256_loadu_si256((const __m256i*)(lengths + c));
+        // Even and odd lanes are multiplied separately into 64-bit products
+        sum = _mm256_add_epi64(sum, _mm256_mul_epu32(h, l));
+        sum = _mm256_add_epi64(sum, _mm256_mul_epu32(_mm256_srli_epi64(h, 32), _mm256_srli_epi64(l, 32)));
+    }
+    unsigned long long lanes[4];
+    _mm256_storeu_si256((__m256i*)lanes, sum);
+    return lanes[0] + lanes[1] + lanes[2] + lanes[3];
+}
+#endif
+
+// Pick the best cost kernel for the running CPU
+CostKernel selectCostKernel() {
+#ifdef HUFFMAN_X86_KERNELS
+    if (__builtin_cpu_supports("avx2")) return costAvx2;
+#endif
+    return costScalar;
+}
+
+// CodebookSet holds K codebooks trained on clusters of a corpus. Each message
+// is encoded with the codebook that gives it the fewest bits, and the index of
+// that codebook is written in the first byte.
+class CodebookSet {
+private:
+    vector<CodeTable*> tables;  // One codebook per cluster
+    vector<vector<uint32_t>> lengths;  // lengths[k][c] = code length of byte c in table k
+    vector<vector<int>> counts;  // Training counts of each table, enough to rebuild it
+    CostKernel cost;  // Dot-product kernel chosen for this CPU
+
+    // Count the bytes of a message
+    static void histogram(const string& message, uint32_t hist[256]) {
+        fill(hist, hist + 256, 0);
+        for (char c : message) hist[(unsigned char)c]++;
+    }
+
+    // Squared distance between two normalized histograms
+    static double distance(const vector<double>& a, const vector<double>& b) {
+        double d = 0.0;
+        for (int c = 0; c < 256; c++) d += (a[c] - b[c]) * (a[c] - b[c]);
+        return d;
+    }
+
+    // Replace the codebooks with ones built from the given per-cluster counts
+    void rebuild(const vector<vector<int>>& clusterCounts) {
+        clear();
+        counts = clusterCounts;
+        for (size_t k = 0; k < counts.size(); k++) {
+            CodeTable* table = CodeTable::fromCounts(k, counts[k].data());
+            vector<uint32_t> length(256);
+            for (int c = 0; c < 256; c++) length[c] = table->codeLength((char)c);
+            tables.push_back(table);
+            lengths.push_back(length);
+        }
+    }
+
+    void clear() {
+        for (CodeTable* table : tables) delete table;
+        tables.clear();
+        lengths.clear();
+        counts.clear();
+    }
+
+public:
+    static constexpr int MAX_TABLES = 256;  // The table index is stored in one byte
+
+    CodebookSet() { cost = selectCostKernel(); }
+    ~CodebookSet() { clear(); }
+
+    CodebookSet(const CodebookSet&) = delete;
+    CodebookSet& operator=(const CodebookSet&) = delete;
+
+    int size() { return tables.size(); }
+    CodeTable* getTable(int k) { return tables[k]; }
+
+    // Cluster the corpus into k groups and train one codebook per group.
+    // Messages are first clustered by k-means over their normalized histograms,
+    // then reassigned to the codebook that encodes them in the fewest bits.
+    // k is clamped to 1..min(corpus size, MAX_TABLES). Returns false, keeping
+    // the current codebooks, if the corpus is empty.
+    bool train(const vector<string>& corpus, int k, int iterations = 10) {
+        size_t n = corpus.size();
+        if (n == 0) return false;
+        k = max(1, min(k, (int)min<size_t>(n, MAX_TABLES)));
+        vector<vector<double>> points(n, vector<double>(256, 0.0));
+        vector<int> assignment(n, 0);
+
+        for (size_t i = 0; i < n; i++) {
+            for (char c : corpus[i]) points[i][(unsigned char)c] += 1.0;
+            for (double& x : points[i]) x /= max<size_t>(corpus[i].length(), 1);
+        }
+
+        // k-means++ seeding with a fixed seed so training is repeatable
+        mt19937 rng(2024);
+        vector<vector<double>> centers;
+        vector<double> nearest(n, 1e300);
+        centers.push_back(points[rng() % n]);
+        while ((int)centers.size() < k) {
+            double total = 0.0;
+            for (size_t i = 0; i < n; i++) {
+                nearest[i] = min(nearest[i], distance(points[i], centers.back()));
+                total += nearest[i];
+            }
+            double target = uniform_real_distribution<double>(0.0, total)(rng);
+            size_t pick = 0;
+            for (; pick + 1 < n && target > nearest[pick]; pick++) target -= nearest[pick];
+            centers.push_back(points[pick]);
+        }
+
+        // Lloyd iterations
+        for (int it = 0; it < iterations; it++) {
+            for (size_t i = 0; i < n; i++) {
+                int best = 0;
+                for (int j = 1; j < k; j++) {
+                    if (distance(points[i], centers[j]) < distance(points[i], centers[best])) best = j;
+                }
+                assignment[i] = best;
+            }
+            vector<int> members(k, 0);
+            for (vector<double>& center : centers) fill(center.begin(), center.end(), 0.0);
+            for (size_t i = 0; i < n; i++) {
+                members[assignment[i]]++;
+                for (int c = 0; c < 256; c++) centers[assignment[i]][c] += points[i][c];
+            }
+            for (int j = 0; j < k; j++) {
+                for (double& x : centers[j]) x /= max(members[j], 1);
+            }
+        }
+
+        // Train on the clusters, then refine once by the real encoded size
+        for (int pass = 0; pass < 2; pass++) {
+            vector<vector<int>> clusterCounts(k, vector<int>(256, 0));
+            for (size_t i = 0; i < n; i++) {
+                for (char c : corpus[i]) clusterCounts[assignment[i]][(unsigned char)c]++;
+            }
+            rebuild(clusterCounts);
+            if (pass == 0) {
+                for (size_t i = 0; i < n; i++) assignment[i] = select(corpus[i]);
+            }
+        }
+        return true;
+    }
+
+    // Index of the codebook that encodes the message in the fewest bits
+    int select(const string& message) {
+        alignas(32) uint32_t hist[256];
+        histogram(message, hist);
+        return select(hist);
+    }
+
+    // Index of the codebook that encodes bytes with these counts in the fewest bits
+    int select(const uint32_t hist[256]) {
+        int best = 0;
+        unsigned long long bestCost = ~0ULL;
+        for (size_t k = 0; k < tables.size(); k++) {
+            unsigned long long bits = cost(hist, lengths[k].data());
+            if (bits < bestCost) {
+                bestCost = bits;
+                best = k;
+            }
+        }
+        return best;
+    }
+
+    // Encode a message with its cheapest codebook, prefixed by the codebook index byte
+    string encode(const string& message) {
+        workloadCapture().record("codebooks", message);
+        if (tables.empty()) return "";
+        int k = select(message);
+        string encoded;
+        appendBits(encoded, k, 8);
+        return encoded + tables[k]->encode(message);
+    }
+
+    // Decode a message produced by encode()
+    string decode(const string& encoded) {
+        size_t pos = 0;
+        size_t k = readBits(encoded, pos, 8);
+        if (k >= tables.size()) return "";
+        return tables[k]->decode(encoded.substr(pos));
+    }
+
+    // Save the training counts; load() rebuilds exactly the same codebooks from them
+    bool save(const string& path) {
+        ofstream out(path);
+        if (!out) return false;
+        out << counts.size() << "\n";
+        for (const vector<int>& table : counts) {
+            for (int c = 0; c < 256; c++) out << table[c] << (c == 255 ? "\n" : " ");
+        }
+        return (bool)out;
+    }
+
+    // Load codebooks written by save()
+    bool load(const string& path) {
+        ifstream in(path);
+        int k;
+        if (!(in >> k) || k < 1 || k > MAX_TABLES) return false;
+
+        vector<vector<int>> clusterCounts(k, vector<int>(256, 0));
+        for (vector<int>& table : clusterCounts) {
+            for (int& count : table) {
+                if (!(in >> count) || count < 0) return false;
+            }
+        }
+        rebuild(clusterCounts);
+        return true;
+    }
+};
+
+// StreamMultiplexer codes many low-rate logical streams into one output with
+// the codebooks of a shared CodebookSet. A stream keeps only a StreamState:
+// a decaying byte histogram that picks its codebook, the codebook index, and
+// a small packed bit buffer. When the buffer is full, the codebook changes or
+// flush() is called, the buffer is written as a frame tagged with the stream ID:
+//   32-bit stream ID, 8-bit codebook index, 16-bit byte count, codes, padding to a byte
+// States live in one contiguous array. When more than maxResident streams are
+// active, a CLOCK sweep flushes and drops a state that was not used recently.
+class StreamMultiplexer {
+public:
+    static constexpr int FRAME_BYTES = 192;  // Packed payload bytes buffered per stream
+    static constexpr int RESELECT_BYTES = 256;  // Input bytes between codebook choices
+
+private:
+    // StreamState is everything a stream keeps between writes
+    struct alignas(64) StreamState {
+        uint32_t id;  // Stream ID written in front of its frames
+        uint16_t symbols;  // Bytes coded into the buffer
+        uint16_t bits;  // Bits used in the buffer
+        uint16_t sinceSelect;  // Input bytes since the codebook was chosen
+        uint8_t table;  // Codebook index in the shared set
+        uint8_t referenced;  // Set on use, cleared by the CLOCK hand
+        uint8_t hist[256];  // Byte counts, halved when one saturates
+        uint8_t buffer[FRAME_BYTES];  // Packed codes not yet framed
+    };
+
+    CodebookSet& codebooks;  // Shared codebooks and their decode tables
+    vector<StreamState> states;  // Resident stream states
+    unordered_map<uint32_t, size_t> slots;  // Stream ID -> index in states
+    size_t maxResident;  // States kept before the CLOCK sweep evicts one
+    size_t hand;  // Position of the CLOCK hand
+    string output;  // Frames written so far, as a bit string
+    size_t evictions;  // States dropped by the CLOCK sweep
+
+    // Write the buffered codes of a stream as one frame
+    void writeFrame(StreamState& state) {
+        if (state.symbols == 0) return;
+        appendBits(output, state.id, 32);
+        appendBits(output, state.table, 8);
+        appendBits(output, state.symbols, 16);
+        for (int i = 0; i < state.bits; i++) output += ((state.buffer[i >> 3] >> (7 - (i & 7))) & 1) ? '1' : '0';
+        output.append((8 - output.length() % 8) % 8, '0');
+        state.symbols = 0;
+        state.bits = 0;
+        fill(state.buffer, state.buffer + FRAME_BYTES, 0);
+    }
+
+    // Pick the codebook that suits the recent bytes of a stream
+    void reselect(StreamState& state) {
+        alignas(32) uint32_t hist[256];
+        for (int c = 0; c < 256; c++) hist[c] = state.hist[c];
+        int best = codebooks.select(hist);
+        if (best != state.table) {
+            writeFrame(state);
+            state.table = best;
+        }
+        state.sinceSelect = 0;
+    }
+
+    // Find the state of a stream, making room for it if it is new
+    StreamState& stateOf(uint32_t id) {
+        unordered_map<uint32_t, size_t>::iterator it = slots.find(id);
+        if (it != slots.end()) {
+            states[it->second].referenced = 1;
+            return states[it->second];
+        }
+
+        size_t slot = states.size();
+        if (states.size() >= maxResident) {
+            // CLOCK: skip recently used states once, then evict the first one that was not
+            while (states[hand].referenced) {
+                states[hand].referenced = 0;
+                hand = (hand + 1) % states.size();
+            }
+            slot = hand;
+            hand = (hand + 1) % states.size();
+            writeFrame(states[slot]);
+            slots.erase(states[slot].id);
+            evictions++;
+        } else {
+            states.emplace_back();
+        }
+
+        StreamState& state = states[slot];
+        state = StreamState();
+        state.id = id;
+        state.referenced = 1;
+        state.sinceSelect = RESELECT_BYTES;  // Choose a codebook on the first write
+        slots[id] = slot;
+        return state;
+    }
+
+public:
+    StreamMultiplexer(CodebookSet& codebooks, size_t maxResident = 4096) : codebooks(codebooks) {
+        this->maxResident = max<size_t>(1, maxResident);
+        states.reserve(this->maxResident);
+        hand = 0;
+        evictions = 0;
+    }
+
+    // Append data to a stream. The codebook is chosen again between writes
+    // once RESELECT_BYTES bytes went through the current one.
+    void write(uint32_t id, const string& data) {
+        workloadCapture().record("mux", data);
+        if (codebooks.size() == 0) return;
+        StreamState& state = stateOf(id);
+
+        for (unsigned char c : data) {
+            if (state.hist[c] == 255) {
+                for (uint8_t& count : state.hist) count >>= 1;
+            }
+            state.hist[c]++;
+        }
+        if (state.sinceSelect >= RESELECT_BYTES) reselect(state);
+        state.sinceSelect = min<size_t>(state.sinceSelect + data.length(), RESELECT_BYTES);
+
+        CodeTable* table = codebooks.getTable(state.table);
+        for (char c : data) {
+            const string& code = table->codeOf(c);
+            if (state.bits + code.length() > FRAME_BYTES * 8) writeFrame(state);
+            for (char bit : code) {
+                if (bit == '1') state.buffer[state.bits >> 3] |= 0x80 >> (state.bits & 7);
+                state.bits++;
+            }
+            state.symbols++;
+        }
+    }
+
+    // Write the buffered codes of every stream
+    void flush() {
+        for (StreamState& state : states) writeFrame(state);
+    }
+
+    // Remove and return the frames written so far
+    string takeOutput() {
+        string frames;
+        frames.swap(output);
+        return frames;
+    }
+
+    size_t getResident() { return states.size(); }
+    size_t getEvictions() { return evictions; }
+    static size_t stateBytes() { return sizeof(StreamState); }
+
+    // Split frames produced by a StreamMultiplexer back into streams.
+    // Returns false if the bits are malformed.
+    static bool demultiplex(CodebookSet& codebooks, const string& bits, unordered_map<uint32_t, string>& streams) {
+        size_t pos = 0;
+        while (pos < bits.length()) {
+            if (pos + 56 > bits.length()) return false;
+            uint32_t id = readBits(bits, pos, 32);
+            int table = readBits(bits, pos, 8);
+            size_t count = readBits(bits, pos, 16);
+            if (table >= codebooks.size()) return false;
+            if (!codebooks.getTable(table)->getTree().decodeCount(bits, pos, count, streams[id])) return false;
+            pos += (8 - pos % 8) % 8;
+        }
+        return pos == bits.length();
+    }
+};
+
+// CompressedCache keeps values in RAM coded with the shared codebooks of a
+// CodebookSet, so more of them fit in the same memory. Keys are spread over
+// independently locked shards. Each shard charges its entries against an
+// equal part of the byte budget and evicts with a CLOCK sweep: a hit sets the
+// entry's reference bit, and the hand clears bits until it finds an entry
+// that was not used since its last pass. A hit decodes only the one value,
+// with the hardened packed decoder of the entry's codebook.
+class CompressedCache {
+public:
+    static constexpr int SHARDS = 16;
+    static constexpr size_t ENTRY_OVERHEAD = 64;  // Bytes charged per entry for the index and bookkeeping
+
+private:
+    // Slot holds one cached value
+    struct Slot {
+        string key;
+        string stored;  // Packed codes plus padding for the decoder, or the raw value
+        uint32_t bits;  // Number of code bits; unused for raw values
+        uint32_t length;  // Length of the value
+        int16_t table;  // Codebook index, -1 for a raw value
+        bool referenced;  // Used since the CLOCK hand last passed
+        bool live;
+    };
+
+    // Shard is an independently locked part of the cache
+    struct Shard {
+        mutex lock;
+        unordered_map<string, size_t> index;  // Key -> slot
+        vector<Slot> slots;
+        vector<size_t> freeSlots;
+        size_t hand = 0;  // Position of the CLOCK hand
+        size_t bytes = 0;  // Bytes charged for the live entries
+    };
+
+    CodebookSet* codebooks;  // Shared codebooks, nullptr to store values raw
+    size_t shardBudget;  // Bytes each shard may charge
+    Shard shards[SHARDS];
+    atomic<size_t> hits, misses, evictions;
+    atomic<size_t> rawBytes;  // Decoded size of the live values
+
+    static size_t charge(const Slot& slot) { return slot.key.length() + slot.stored.length() + ENTRY_OVERHEAD; }
+
+    Shard& shardOf(const string& key) { return shards[hash<string>()(key) % SHARDS]; }
+
+    // Remove a live slot from its shard; the caller holds the shard lock
+    void release(Shard& shard, size_t s) {
+        Slot& slot = shard.slots[s];
+        shard.bytes -= charge(slot);
+        rawBytes -= slot.length;
+        shard.index.erase(slot.key);
+        slot.live = false;
+        slot.key.clear();
+        slot.stored.clear();
+        slot.stored.shrink_to_fit();
+        shard.freeSlots.push_back(s);
+    }
+
+    // Evict with the CLOCK sweep until needed more bytes fit; caller holds the lock
+    void makeRoom(Shard& shard, size_t needed) {
+        while (shard.bytes + needed > shardBudget && !shard.index.empty()) {
+            Slot& slot = shard.slots[shard.hand];
+            if (slot.live && slot.referenced) {
+                slot.referenced = false;
+            } else if (slot.live) {
+                release(shard, shard.hand);
+                evictions++;
+            }
+            shard.hand = (shard.hand + 1) % shard.slots.size();
+        }
+    }
+
+public:
+    // codebooks may be nullptr to cache raw values, as a baseline
+    CompressedCache(CodebookSet* codebooks, size_t budgetBytes)
+        : codebooks(codebooks), hits(0), misses(0), evictions(0), rawBytes(0) {
+        shardBudget = budgetBytes / SHARDS;
+    }
+
+    // Insert or replace a value. Values that would not fit in a shard are not
+    // cached, and drop any older value of their key.
+    void put(const string& key, const string& value) {
+        workloadCapture().record("cache", value);
+        Slot slot;
+        slot.key = key;
+        slot.bits = 0;
+        slot.length = value.length();
+        slot.table = -1;
+        slot.referenced = false;
+        slot.live = true;
+        if (codebooks && codebooks->size() > 0) {
+            int k = codebooks->select(value);
+            string bits = codebooks->getTable(k)->encode(value);
+            if ((bits.length() + 7) / 8 + HuffmanTree::INPUT_PADDING < value.length()) {
+                slot.stored = packBits(bits);
+                slot.stored.append(HuffmanTree::INPUT_PADDING, '\0');
+                slot.bits = bits.length();
+                slot.table = k;
+            }
+        }
+        if (slot.table < 0) slot.stored = value;  // Coding would not save anything
+
+        Shard& shard = shardOf(key);
+        lock_guard<mutex> guard(shard.lock);
+        unordered_map<string, size_t>::iterator it = shard.index.find(key);
+        if (it != shard.index.end()) release(shard, it->second);
+        if (charge(slot) > shardBudget) return;
+        makeRoom(shard, charge(slot));
+
+        size_t s = shard.slots.size();
+        if (!shard.freeSlots.empty()) {
+            s = shard.freeSlots.back();
+            shard.freeSlots.pop_back();
+        } else {
+            shard.slots.emplace_back();
+        }
+        shard.bytes += charge(slot);
+        shard.index[key] = s;
+        shard.slots[s] = move(slot);
+        rawBytes += value.length();
+    }
+
+    // Look a key up and decode its value; false on a miss
+    bool get(const string& key, string& value) {
+        Shard& shard = shardOf(key);
+        lock_guard<mutex> guard(shard.lock);
+        unordered_map<string, size_t>::iterator it = shard.index.find(key);
+        if (it == shard.index.end()) {
+            misses++;
+            return false;
+        }
+
+        Slot& slot = shard.slots[it->second];
+        slot.referenced = true;
+        hits++;
+        if (slot.table < 0) {
+            value = slot.stored;
+            return true;
+        }
+        return codebooks->getTable(slot.table)->getTree().decodePacked((const uint8_t*)slot.stored.data(), slot.bits, value);
+    }
+
+    // Remove a key if it is cached
+    void erase(const string& key) {
+        Shard& shard = shardOf(key);
+        lock_guard<mutex> guard(shard.lock);
+        unordered_map<string, size_t>::iterator it = shard.index.find(key);
+        if (it != shard.index.end()) release(shard, it->second);
+    }
+
+    size_t getEntries() {
+        size_t entries = 0;
+        for (Shard& shard : shards) {
+            lock_guard<mutex> guard(shard.lock);
+            entries += shard.index.size();
+        }
+        return entries;
+    }
+
+    size_t getChargedBytes() {
+        size_t bytes = 0;
+        for (Shard& shard : shards) {
+            lock_guard<mutex> guard(shard.lock);
+            bytes += shard.bytes;
+        }
+        return bytes;
+    }
+
+    size_t getRawBytes() { return rawBytes; }
+    size_t getHits() { return hits; }
+    size_t getMisses() { return misses; }
+    size_t getEvictions() { return evictions; }
+};
+
+// FlushPolicy decides when a StreamingEncoder closes a partial block.
+// Zero disables a limit; flush() can always be called explicitly.
+struct FlushPolicy {
+    size_t maxBytes;  // Close the block once this many bytes are pending
+    int maxMillis;  // Close the block once its oldest byte waited this long
+};
+
+// FlushStats reports what a flush policy cost in latency and ratio
+struct FlushStats {
+    size_t frames;  // Frames written
+    size_t inputBytes;  // Bytes accepted by write()
+    size_t outputBits;  // Bits written, including headers and padding
+    size_t headerBits;  // Bits spent on frame headers, trees and padding
+    double totalWaitMillis;  // Sum over frames of the wait of their oldest byte
+    double maxWaitMillis;  // Longest wait of any byte
+};
+
+// StreamingEncoder cuts an input stream into self-contained frames. A frame
+// starts with a 2-bit mode and a 16-bit character count, is padded to a
+// whole byte and can be decoded as soon as it is written:
+//   STORED     raw 8-bit characters, for blocks that would not compress
+//   REUSE      codes of the previous NEW_TABLE frame, no tree is sent
+//   NEW_TABLE  a serialized tree followed by the codes
+class StreamingEncoder {
+public:
+    typedef chrono::steady_clock::time_point TimePoint;
+    enum FrameMode { STORED = 0, REUSE = 1, NEW_TABLE = 2 };
+    static constexpr size_t MAX_BLOCK = 65535;  // Largest count the 16-bit field can hold
+
+private:
+    size_t blockSize;  // A full block is always closed
+    FlushPolicy policy;  // Limits that close a partial block early
+    string pending;  // Bytes waiting for the current block to close
+    TimePoint oldest;  // Arrival time of the first pending byte
+    string output;  // Frames written and not yet taken
+    HuffmanTree* previous;  // Tree of the last NEW_TABLE frame, nullptr before the first
+    string previousCode[256];  // Codes of that tree
+    bool previousHas[256];  // True for the characters that tree can encode
+    FlushStats stats;
+
+    // Close the pending block as one frame
+    void writeFrame(TimePoint now) {
+        if (pending.empty()) return;
+
+        int counts[256] = {0};
+        for (char c : pending) counts[(unsigned char)c]++;
+
+        // Cost of reusing the previous table, if it covers every character
+        size_t reuseBits = previous ? 0 : SIZE_MAX;
+        for (int c = 0; c < 256 && reuseBits != SIZE_MAX; c++) {
+            if (counts[c] == 0) continue;
+            reuseBits = previousHas[c] ? reuseBits + (size_t)counts[c] * previousCode[c].length() : SIZE_MAX;
+        }
+
+        // Cost of a new table including its serialized tree
+        FrequencyTable table;
+        for (int c = 0; c < 256; c++) {
+            if (counts[c] > 0) table.AddFrequency((char)c, counts[c]);
+        }
+        HuffmanTree* fresh = new HuffmanTree();
+        fresh->buildTree(table);
+        unordered_map<char, string> codes = fresh->generateCodes();
+        string treeBits;
+        fresh->serialize(treeBits);
+        size_t newBits = treeBits.length();
+        for (const pair<const char, string>& p : codes) {
+            newBits += (size_t)counts[(unsigned char)p.first] * p.second.length();
+        }
+
+        size_t storedBits = pending.length() * 8;
+        size_t start = output.length();
+        size_t payloadBits;
+
+        if (reuseBits <= newBits && reuseBits <= storedBits) {
+            appendBits(output, REUSE, 2);
+            appendBits(output, pending.length(), 16);
+            for (char c : pending) output += previousCode[(unsigned char)c];
+            payloadBits = reuseBits;
+            delete fresh;
+        } else if (newBits < storedBits) {
+            appendBits(output, NEW_TABLE, 2);
+            appendBits(output, pending.length(), 16);
+            output += treeBits;
+            for (char c : pending) output += codes[c];
+            payloadBits = newBits - treeBits.length();
+
+            delete previous;
+            previous = fresh;
+            for (int c = 0; c < 256; c++) {
+                previousHas[c] = counts[c] > 0;
+                previousCode[c] = previousHas[c] ? codes[(char)c] : "";
+            }
+        } else {
+            appendBits(output, STORED, 2);
+            appendBits(output, pending.length(), 16);
+            for (char c : pending) appendBits(output, (unsigned char)c, 8);
+            payloadBits = storedBits;
+            delete fresh;
+        }
+
+        // Pad to a byte boundary so the consumer can decode the frame right away
+        output.append((8 - output.length() % 8) % 8, '0');
+
+        double wait = chrono::duration<double, milli>(now - oldest).count();
+        stats.frames++;
+        stats.outputBits += output.length() - start;
+        stats.headerBits += output.length() - start - payloadBits;
+        stats.totalWaitMillis += wait;
+        stats.maxWaitMillis = max(stats.maxWaitMillis, wait);
+        pending.clear();
+    }
+
+public:
+    StreamingEncoder(FlushPolicy policy, size_t blockSize = tuningProfile().blockSize) {
+        this->policy = policy;
+        this->blockSize = max<size_t>(1, min(blockSize, MAX_BLOCK));
+        previous = nullptr;
+        fill(previousHas, previousHas + 256, false);
+        stats = {0, 0, 0, 0, 0.0, 0.0};
+    }
+
+    ~StreamingEncoder() { delete previous; }
+
+    StreamingEncoder(const StreamingEncoder&) = delete;
+    StreamingEncoder& operator=(const StreamingEncoder&) = delete;
+
+    // Append data to the stream, closing blocks as the policy requires
+    void write(const string& data, TimePoint now = chrono::steady_clock::now()) {
+        workloadCapture().record("stream", data);
+        poll(now);
+        stats.inputBytes += data.length();
+
+        for (size_t i = 0; i < data.length();) {
+            if (pending.empty()) oldest = now;
+            size_t take = min(data.length() - i, blockSize - pending.length());
+            pending.append(data, i, take);
+            i += take;
+
+            if (pending.length() >= blockSize || (policy.maxBytes > 0 && pending.length() >= policy.maxBytes)) {
+                writeFrame(now);
+            }
+        }
+    }
+
+    // Close the pending block if its oldest byte waited at least maxMillis.
+    // Call it from the sender's timer when no data is arriving.
+    void poll(TimePoint now = chrono::steady_clock::now()) {
+        if (!pending.empty() && policy.maxMillis > 0 && now - oldest >= chrono::milliseconds(policy.maxMillis)) {
+            writeFrame(now);
+        }
+    }
+
+    // Close the pending block now
+    void flush(TimePoint now = chrono::steady_clock::now()) { writeFrame(now); }
+
+    // Remove and return the frames written so far; always a whole number of bytes
+    string takeOutput() {
+        string frames;
+        frames.swap(output);
+        return frames;
+    }
+
+    const FlushStats& getStats() { return stats; }
+};
+
+// StreamingDecoder decodes the frames of a StreamingEncoder as they arrive
+class StreamingDecoder {
+private:
+    string buffered;  // Bits not decoded yet, starting at a frame boundary
+    HuffmanTree* previous;  // Tree of the last NEW_TABLE frame, nullptr before the first
+    bool failed;  // Set once a malformed frame was seen
+
+    // Decode the frame at pos. Returns false if it is incomplete, and sets
+    // malformed if it can never be decoded.
+    bool decodeFrame(size_t& pos, string& out, bool& malformed) {
+        size_t p = pos;
+        size_t before = out.length();
+        if (p + 18 > buffered.length()) return false;
+
+        int mode = readBits(buffered, p, 2);
+        size_t count = readBits(buffered, p, 16);
+        bool complete;
+        // A step that fails with at least limit bits buffered from start on
+        // failed on the bits themselves, not for lack of them
+        size_t start = p, limit = count * HuffmanTree::MAX_CODE_BITS + 7;
+
+        if (mode == StreamingEncoder::STORED) {
+            complete = p + count * 8 <= buffered.length();
+            for (size_t i = 0; complete && i < count; i++) out += (char)readBits(buffered, p, 8);
+        } else if (mode == StreamingEncoder::REUSE) {
+            if (!previous) {  // No table to reuse yet
+                malformed = true;
+                return false;
+            }
+            complete = previous->decodeCount(buffered, p, count, out);
+        } else if (mode == StreamingEncoder::NEW_TABLE) {
+            // The tree is only kept once the whole frame has arrived
+            HuffmanTree* tree = new HuffmanTree();
+            complete = tree->deserialize(buffered, p);
+            if (!complete) {
+                limit = HuffmanTree::MAX_TREE_BITS;
+            } else {
+                start = p;
+                complete = tree->decodeCount(buffered, p, count, out) && p + (8 - p % 8) % 8 <= buffered.length();
+            }
+            if (complete) {
+                delete previous;
+                previous = tree;
+            } else {
+                delete tree;
+            }
+        } else {
+            malformed = true;
+            return false;
+        }
+
+        size_t end = p + (8 - p % 8) % 8;
+        if (!complete || end > buffered.length()) {
+            out.resize(before);
+            if (!complete && buffered.length() - start >= limit) malformed = true;
+            return false;
+        }
+        pos = end;
+        return true;
+    }
+
+public:
+    StreamingDecoder() { previous = nullptr; failed = false; }
+    ~StreamingDecoder() { delete previous; }
+
+    StreamingDecoder(const StreamingDecoder&) = delete;
+    StreamingDecoder& operator=(const StreamingDecoder&) = delete;
+
+    // Feed bits received from the encoder and return the characters of every
+    // complete frame. Incomplete frames are kept until more bits arrive.
+    string feed(const string& bits) {
+        string out;
+        size_t pos = 0;
+        bool malformed = false;
+
+        buffered += bits;
+        while (!failed && decodeFrame(pos, out, malformed)) {}
+        if (malformed) failed = true;
+        buffered.erase(0, pos);
+        return out;
+    }
+
+    bool hasFailed() { return failed; }
+};
+
+// CanonicalCode assigns canonical codes to a list of symbols ordered by
+// non-decreasing code length: each code is the previous one plus one,
+// shifted left when the length grows. Only the symbols and lengths have to
+// be stored to rebuild the same codes.
+struct CanonicalCode {
+    uint32_t code[256];  // Code of each byte value
+    unsigned char length[256];  // Length of each code, 0 if the byte has none
+    int firstCode[33];  // First code of each length
+    int firstIndex[33];  // Position in 'sorted' of the first symbol of each length
+    int countOf[33];  // Number of codes of each length
+    unsigned char sorted[256];  // Symbols in canonical order
+    int maxLength;
+
+    // Build the decoding tables from symbols listed by non-decreasing length.
+    // Returns false if the list is out of order or is not a prefix code.
+    bool buildOrdered(const unsigned char* symbols, const unsigned char* lengths, int n) {
+        fill(countOf, countOf + 33, 0);
+        maxLength = 0;
+        for (int i = 0; i < n; i++) {
+            if (lengths[i] < maxLength || lengths[i] > 32) return false;
+            maxLength = lengths[i];
+            countOf[maxLength]++;
+            sorted[i] = symbols[i];
+        }
+
+        uint64_t next = 0;
+        int position = countOf[0];
+        for (int l = 1; l <= 32; l++) {
+            firstIndex[l] = position;
+            firstCode[l] = next;
+            position += countOf[l];
+            next = (next + countOf[l]) << 1;
+            if (l <= maxLength && (next >> 1) > (1ULL << l)) return false;
+        }
+        return true;
+    }
+
+    // Build encoding and decoding tables from the code length of every byte value
+    void build(const unsigned char lengths[256]) {
+        unsigned char symbols[256], ordered[256];
+        int n = 0;
+        for (int l = 1; l <= 32; l++) {
+            for (int c = 0; c < 256; c++) {
+                if (lengths[c] == l) {
+                    symbols[n] = c;
+                    ordered[n++] = l;
+                }
+            }
+        }
+        buildOrdered(symbols, ordered, n);
+
+        for (int c = 0; c < 256; c++) length[c] = lengths[c];
+        for (int i = 0; i < n; i++) {
+            int l = ordered[i];
+            code[symbols[i]] = firstCode[l] + (i - firstIndex[l]);
+        }
+    }
+
+    // Decode one symbol, -1 if the bits match no code
+    int decode(BitReader& reader) const {
+        int value = 0;
+        for (int l = 1; l <= maxLength; l++) {
+            value = (value << 1) | reader.bit();
+            int offset = value - firstCode[l];
+            if (offset >= 0 && offset < countOf[l]) return sorted[firstIndex[l] + offset];
+        }
+        return -1;
+    }
+};
+
+// Sort N keys in place with a bitonic sorting network (N a power of two).
+// The sequence of compare-exchanges does not depend on the data, so there
+// are no branches to mispredict and the inner loop vectorizes.
+template <int N>
+void sortingNetwork(uint32_t* keys) {
+#pragma GCC unroll 8
+    for (int k = 2; k <= N; k <<= 1) {
+#pragma GCC unroll 8
+        for (int j = k >> 1; j > 0; j >>= 1) {
+#pragma GCC unroll 32
+            for (int p = 0; p < N / 2; p++) {
+                // p-th index with bit j clear, paired with the index that has it set
+                int i = ((p & ~(j - 1)) << 1) | (p & (j - 1));
+                int l = i | j;
+                uint32_t a = keys[i], b = keys[l];
+                uint32_t low = min(a, b), high = max(a, b);
+                bool ascending = (i & k) == 0;
+                keys[i] = ascending ? low : high;
+                keys[l] = ascending ? high : low;
+            }
+        }
+    }
+}
+
+#ifdef HUFFMAN_X86_KERNELS
+// The same bitonic network on 16, 32 or 64 keys held in REGS AVX-512
+// registers. Each stage compares every key with its partner i ^ j, found by a
+// lane permutation inside a register or in another register for j >= 16,
+// and a precomputed lane mask picks the minimum or the maximum.
+template <int REGS>
+__attribute__((target("avx512f")))
+void sortingNetworkAvx512(uint32_t* keys) {
+    static const struct Masks {
+        __mmask16 takeMin[21][4];  // Per stage and register: lanes that keep the minimum
+        Masks() {
+            int stage = 0;
+            for (int k = 2; k <= 64; k <<= 1) {
+                for (int j = k >> 1; j > 0; j >>= 1, stage++) {
+                    for (int r = 0; r < 4; r++) {
+                        takeMin[stage][r] = 0;
+                        for (int lane = 0; lane < 16; lane++) {
+                            int i = 16 * r + lane;
+                            if (((i & j) == 0) == ((i & k) == 0)) takeMin[stage][r] |= 1 << lane;
+                        }
+                    }
+                }
+            }
+        }
+    } masks;
+
+    __m512i v[REGS];
+    for (int r = 0; r < REGS; r++) v[r] = _mm512_loadu_si512(keys + 16 * r);
+
+    int stage = 0;
+    for (int k = 2; k <= 16 * REGS; k <<= 1) {
+        for (int j = k >> 1; j > 0; j >>= 1, stage++) {
+            __m512i partner[REGS];
+            if (j >= 16) {
+                for (int r = 0; r < REGS; r++) partner[r] = v[r ^ (j / 16)];
+            } else {
+                __m512i index = _mm512_xor_si512(_mm512_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15),
+                                                 _mm512_set1_epi32(j));
+                for (int r = 0; r < REGS; r++) partner[r] = _mm512_maskz_permutexvar_epi32(0xFFFF, index, v[r]);
+            }
+            for (int r = 0; r < REGS; r++) {
+                __mmask16 takeMin = masks.takeMin[stage][r];
+                __m512i high = _mm512_mask_max_epu32(v[r], (__mmask16)~takeMin, v[r], partner[r]);
+                v[r] = _mm512_mask_min_epu32(high, takeMin, v[r], partner[r]);
+            }
+        }
+    }
+
+    for (int r = 0; r < REGS; r++) _mm512_storeu_si512(keys + 16 * r, v[r]);
+}
+#endif
+
+// Sort the first n keys (n <= 64) with the smallest network that holds them,
+// in AVX-512 registers when the CPU has them. Unused slots must hold UINT32_MAX.
+void sortSmall(uint32_t keys[64], int n) {
+#ifdef HUFFMAN_X86_KERNELS
+    static const bool avx512 = __builtin_cpu_supports("avx512f");
+    if (avx512) {
+        if (n <= 16) sortingNetworkAvx512<1>(keys);
+        else if (n <= 32) sortingNetworkAvx512<2>(keys);
+        else sortingNetworkAvx512<4>(keys);
+        return;
+    }
+#endif
+    if (n <= 8) sortingNetwork<8>(keys);
+    else if (n <= 16) sortingNetwork<16>(keys);
+    else if (n <= 32) sortingNetwork<32>(keys);
+    else sortingNetwork<64>(keys);
+}
+
+// TinyCodec is a separate path for messages shorter than 64 bytes. It skips
+// the frequency table and tree: the histogram is computed by comparing the
+// message against itself in SIMD registers, the at most 63 distinct symbols
+// are sorted with a sorting network, and the code lengths come from the
+// two-queue method. The cheapest of three modes is written:
+//   STORED   raw bytes, when coding would expand the message
+//   STATIC   a built-in canonical codebook, no table is sent
+//   DYNAMIC  the symbols by non-decreasing code length, then canonical codes
+// Header: 2-bit mode and 6-bit length. Output is packed, at most MAX_OUTPUT bytes.
+// It is far quicker than the full flow but does not reach its latency target:
+// bench-tiny measures a p99 around 1.5 us against TARGET_P99_NS.
+class TinyCodec {
+public:
+    static constexpr double TARGET_P99_NS = 100;  // Latency the path was designed for
+    enum Mode { STORED = 0, STATIC = 1, DYNAMIC = 2 };
+    static constexpr size_t MAX_INPUT = 63;  // Longest message the tiny path takes
+    static constexpr size_t MAX_OUTPUT = 72;  // Largest encoded size in bytes
+
+private:
+#ifdef HUFFMAN_X86_KERNELS
+    // AVX-512BW version of countSymbols: the whole message sits in one register
+    // and each byte is compared with all 64 positions by a single instruction
+    __attribute__((target("avx512f,avx512bw,popcnt")))
+    static int countSymbolsAvx512(const unsigned char* block, size_t n, uint32_t keys[64]) {
+        __m512i v = _mm512_loadu_si512(block);
+        uint64_t valid = (n == 64) ? ~0ULL : ((1ULL << n) - 1);
+        int distinct = 0;
+        for (size_t i = 0; i < n; i++) {
+            uint64_t mask = _mm512_cmpeq_epi8_mask(v, _mm512_set1_epi8((char)block[i])) & valid;
+            // Written every time but only kept at the first occurrence, without a branch
+            keys[distinct] = (uint32_t)_mm_popcnt_u64(mask) << 8 | block[i];
+            distinct += (mask & ((1ULL << i) - 1)) == 0;
+        }
+        return distinct;
+    }
+#endif
+
+    // Count the distinct bytes of a message. keys[i] = (count << 8) | byte.
+    static int countSymbols(const unsigned char* data, size_t n, uint32_t keys[64]) {
+        alignas(64) unsigned char block[64] = {0};
+        copy(data, data + n, block);
+        uint64_t valid = (n == 64) ? ~0ULL : ((1ULL << n) - 1);
+        int distinct = 0;
+
+#ifdef HUFFMAN_X86_KERNELS
+        static const bool avx512 = __builtin_cpu_supports("avx512bw") && __builtin_cpu_supports("popcnt");
+        if (avx512) return countSymbolsAvx512(block, n, keys);
+#endif
+#if defined(HUFFMAN_X86_KERNELS) && defined(__SSE2__)
+        __m128i v0 = _mm_load_si128((const __m128i*)block);
+        __m128i v1 = _mm_load_si128((const __m128i*)(block + 16));
+        __m128i v2 = _mm_load_si128((const __m128i*)(block + 32));
+        __m128i v3 = _mm_load_si128((const __m128i*)(block + 48));
+        for (size_t i = 0; i < n; i++) {
+            __m128i b = _mm_set1_epi8((char)block[i]);
+            uint64_t mask = (uint64_t)(uint16_t)_mm_movemask_epi8(_mm_cmpeq_epi8(v0, b))
+                          | (uint64_t)(uint16_t)_mm_movemask_epi8(_mm_cmpeq_epi8(v1, b)) << 16
+                          | (uint64_t)(uint16_t)_mm_movemask_epi8(_mm_cmpeq_epi8(v2, b)) << 32
+                          | (uint64_t)(uint16_t)_mm_movemask_epi8(_mm_cmpeq_epi8(v3, b)) << 48;
+            mask &= valid;
+            if (mask & ((1ULL << i) - 1)) continue;  // Counted at its first occurrence
+            keys[distinct++] = (uint32_t)__builtin_popcountll(mask) << 8 | block[i];
+        }
+#else
+        for (size_t i = 0; i < n; i++) {
+            uint64_t mask = 0;
+            for (size_t j = 0; j < 64; j++) mask |= (uint64_t)(block[j] == block[i]) << j;
+            mask &= valid;
+            if (mask & ((1ULL << i) - 1)) continue;
+            keys[distinct++] = (uint32_t)__builtin_popcountll(mask) << 8 | block[i];
+        }
+#endif
+        return distinct;
+    }
+
+    // Code lengths of the sorted keys with the two-queue method; ties go to the
+    // leaf queue, so the result matches buildCodeLengths()
+    static void lengthsFromSorted(const uint32_t keys[64], int distinct, unsigned char lengths[256]) {
+        uint32_t merged[64];
+        int parentOfLeaf[64];
+        int parentOfMerged[64];
+        unsigned char depth[64];
+        int leaf = 0, node = 0;
+
+        if (distinct == 1) {
+            lengths[keys[0] & 0xFF] = 0;
+            return;
+        }
+        // Branch-free picks: unused key slots hold UINT32_MAX, so an exhausted
+        // leaf queue never wins, and an empty merged queue reads as UINT32_MAX
+        for (int s = 0; s < distinct - 1; s++) {
+            uint32_t sum = 0;
+            for (int pick = 0; pick < 2; pick++) {
+                uint32_t leafFreq = keys[leaf] >> 8;
+                uint32_t nodeFreq = node < s ? merged[node] : UINT32_MAX;
+                bool takeLeaf = leafFreq <= nodeFreq;
+                int* parent = takeLeaf ? &parentOfLeaf[leaf] : &parentOfMerged[node];
+                *parent = s;
+                sum += takeLeaf ? leafFreq : nodeFreq;
+                leaf += takeLeaf;
+                node += !takeLeaf;
+            }
+            merged[s] = sum;
+        }
+
+        int root = distinct - 2;
+        depth[root] = 0;
+        for (int s = root - 1; s >= 0; s--) depth[s] = depth[parentOfMerged[s]] + 1;
+        for (int i = 0; i < distinct; i++) lengths[keys[i] & 0xFF] = depth[parentOfLeaf[i]] + 1;
+    }
+
+public:
+    // Built-in codebook trained on a mix of short English, JSON and log text
+    static const CanonicalCode& staticCode() {
+        static const CanonicalCode code = [] {
+            const char* sample =
+                "the quick brown fox jumps over the lazy dog. The service returned OK in 12 ms; "
+                "{\"id\":1024,\"name\":\"alice\",\"active\":true,\"tags\":[\"a\",\"b\"],\"score\":98.6} "
+                "GET /api/v1/users/42 HTTP/1.1 200 OK host=example.com user-agent=curl/8.0 "
+                "2026-10-18T12:00:01Z INFO worker-3 request id=7f3a9c finished status=200 bytes=5120\n"
+                "Hello, world! Thank you for your order. Your package will arrive on Monday.\r\n"
+                "SELECT name, email FROM users WHERE id = 17 AND deleted_at IS NULL;\t0123456789";
+            uint32_t histogram[256];
+            unsigned char lengths[256];
+            CanonicalCode built;
+            fill(histogram, histogram + 256, 1);
+            for (const char* p = sample; *p; p++) histogram[(unsigned char)*p] += 8;
+            buildCodeLengths(histogram, lengths);
+            built.build(lengths);
+            return built;
+        }();
+        return code;
+    }
+
+    // Encode a message of at most MAX_INPUT bytes into out, which must hold
+    // MAX_OUTPUT bytes. Returns the number of bytes written, 0 if n is too large.
+    static size_t encode(const char* message, size_t n, uint8_t* out) {
+        if (n > MAX_INPUT) return 0;
+        workloadCapture().record("tiny", message, n);
+        const unsigned char* data = (const unsigned char*)message;
+        const CanonicalCode& fixed = staticCode();
+        BitWriter writer(out);
+
+        uint32_t keys[64];
+        int distinct = countSymbols(data, n, keys);
+
+        // Sort by (count, byte); unused slots sort to the end
+        fill(keys + distinct, keys + 64, UINT32_MAX);
+        sortSmall(keys, distinct);
+
+        unsigned char lengths[256];
+        size_t storedBits = 8 * n, staticBits = 0, dynamicBits = 6 + 12 * distinct;
+        if (distinct > 0) lengthsFromSorted(keys, distinct, lengths);
+        for (int i = 0; i < distinct; i++) {
+            uint32_t count = keys[i] >> 8;
+            unsigned char c = keys[i] & 0xFF;
+            staticBits += count * fixed.length[c];
+            dynamicBits += count * lengths[c];
+        }
+
+        if (n > 0 && dynamicBits < staticBits && dynamicBits < storedBits) {
+            // Keys are sorted by increasing count, so walking them backwards
+            // lists the symbols by non-decreasing code length: canonical order
+            uint32_t code[256];
+            uint32_t next = 0;
+            int previous = lengths[keys[distinct - 1] & 0xFF];
+
+            writer.put(DYNAMIC, 2);
+            writer.put(n, 6);
+            writer.put(distinct - 1, 6);
+            for (int i = distinct - 1; i >= 0; i--) {
+                unsigned char c = keys[i] & 0xFF;
+                next <<= lengths[c] - previous;
+                previous = lengths[c];
+                code[c] = next++;
+                writer.put(c, 8);
+                writer.put(lengths[c], 4);
+            }
+            for (size_t i = 0; i < n; i++) writer.put(code[data[i]], lengths[data[i]]);
+        } else if (n > 0 && staticBits < storedBits) {
+            writer.put(STATIC, 2);
+            writer.put(n, 6);
+            for (size_t i = 0; i < n; i++) writer.put(fixed.code[data[i]], fixed.length[data[i]]);
+        } else {
+            writer.put(STORED, 2);
+            writer.put(n, 6);
+            for (size_t i = 0; i < n; i++) writer.put(data[i], 8);
+        }
+        return writer.finish();
+    }
+
+    // Decode a message written by encode() into out, which must hold MAX_INPUT
+    // bytes. Returns the message length, or -1 if the input is malformed.
+    static int decode(const uint8_t* in, size_t size, char* out) {
+        BitReader reader(in, size);
+        int mode = reader.get(2);
+        int n = reader.get(6);
+
+        if (mode == STORED) {
+            for (int i = 0; i < n; i++) out[i] = (char)reader.get(8);
+        } else if (mode == STATIC || mode == DYNAMIC) {
+            CanonicalCode dynamic;
+            const CanonicalCode* code = &staticCode();
+
+            int single = -1;  // The only symbol of a one-symbol message, which takes no bits
+
+            if (mode == DYNAMIC) {
+                unsigned char symbols[64], lengths[64] = {0};
+                int distinct = reader.get(6) + 1;
+                for (int i = 0; i < distinct; i++) {
+                    symbols[i] = reader.get(8);
+                    lengths[i] = reader.get(4);
+                }
+                if (distinct == 1) single = symbols[0];
+                else if (lengths[0] == 0 || !dynamic.buildOrdered(symbols, lengths, distinct)) return -1;
+                code = &dynamic;
+            }
+
+            for (int i = 0; i < n; i++) {
+                int c = (single >= 0) ? single : code->decode(reader);
+                if (c < 0) return -1;
+                out[i] = (char)c;
+            }
+        } else {
+            return -1;
+        }
+        return reader.overrun ? -1 : n;
+    }
+};
+
+// Append a byte stream coded with its own table: a 32-bit byte count,
+// the serialized tree and the codes
+void appendHuffmanStream(string& bits, const string& bytes) {
+    appendBits(bits, bytes.length(), 32);
+    if (bytes.empty()) return;
+
+    vector<ByteSegment> segments(1, ByteSegment{bytes.data(), bytes.length()});
+    FrequencyTable table;
+    HuffmanTree tree;
+    table.MakeTable(segments);
+    tree.buildTree(table);
+    unordered_map<char, string> codes = tree.generateCodes();
+    tree.serialize(bits);
+    tree.encode(segments, codes, bits);  // The tree was built from these bytes, so every byte has a code
+}
+
+// Largest stream readHuffmanStream() accepts. A one-leaf stream costs no bits
+// per byte, so without a limit a few corrupt bits could ask for gigabytes.
+size_t& streamByteLimit() {
+    static size_t limit = (size_t)1 << 30;
+    return limit;
+}
+
+// Read a stream written by appendHuffmanStream()
+bool readHuffmanStream(const string& bits, size_t& pos, string& bytes) {
+    if (pos + 32 > bits.length()) return false;
+    size_t count = readBits(bits, pos, 32);
+    bytes.clear();
+    if (count == 0) return true;
+    if (count > streamByteLimit()) return false;
+
+    HuffmanTree tree;
+    if (!tree.deserialize(bits, pos)) return false;
+    // Only a one-leaf tree codes characters in zero bits
+    if (tree.getDecodeTableSize() > sizeof(DecodeEntry) && count > bits.length() - pos) return false;
+    return tree.decodeCount(bits, pos, count, bytes);
+}
+
+// JsonCodec splits JSON text into four symbol streams that are coded with
+// their own Huffman tables:
+//   structure  whitespace, brackets, punctuation and literals, with '"' standing
+//              for a string and '#' for a number
+//   keys       object keys as dictionary IDs; a new key is its ID followed by its text
+//   strings    the raw bodies of string values, each ending at its closing quote
+//   numbers    the text of numbers, each ending with ';'
+// Strings keep their escapes as written, so the text is rebuilt byte for byte.
+// Input the tokenizer cannot split (not JSON) is coded as a single stream.
+class JsonCodec {
+public:
+    enum Mode { SINGLE = 0, SPLIT = 1 };
+
+private:
+    enum Stream { STRUCTURE, KEYS, STRINGS, NUMBERS, STREAM_COUNT };
+    static constexpr char NUMBER_MARK = '#';  // Stands for a number in the structure stream
+    static constexpr char NUMBER_END = ';';  // Ends a number in the numbers stream
+
+    // Index of the closing quote of a string body starting at p, or n if the
+    // string is not terminated. Escapes are skipped as two bytes.
+    static size_t scanString(const char* data, size_t n, size_t p) {
+#if defined(HUFFMAN_X86_KERNELS) && defined(__SSE2__)
+        const __m128i quote = _mm_set1_epi8('"');
+        const __m128i backslash = _mm_set1_epi8('\\');
+        while (p + 16 <= n) {
+            __m128i v = _mm_loadu_si128((const __m128i*)(data + p));
+            int mask = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(v, quote), _mm_cmpeq_epi8(v, backslash)));
+            if (mask == 0) {
+                p += 16;
+                continue;
+            }
+            p += __builtin_ctz(mask);
+            if (data[p] == '"') return p;
+            p += 2;
+        }
+#endif
+        while (p < n) {
+            if (data[p] == '"') return p;
+            p += (data[p] == '\\') ? 2 : 1;
+        }
+        return n;
+    }
+
+    // Bytes that may appear in the structure stream as themselves
+    static bool isStructural(unsigned char c) {
+        static const string allowed = " \t\n\r{}[]:,truefalsn";
+        return allowed.find((char)c) != string::npos;
+    }
+
+    static bool isNumberStart(char c) { return c == '-' || (c >= '0' && c <= '9'); }
+    static bool isNumberPart(char c) { return isNumberStart(c) || c == '+' || c == '.' || c == 'e' || c == 'E'; }
+
+    // Follow brackets and commas to know whether the next string is an object key.
+    // Returns false on a closing bracket that does not match.
+    static bool track(char c, vector<char>& open, bool& expectKey) {
+        if (c == '{' || c == '[') {
+            open.push_back(c);
+            expectKey = (c == '{');
+        } else if (c == '}' || c == ']') {
+            if (open.empty() || open.back() != (c == '}' ? '{' : '[')) return false;
+            open.pop_back();
+            expectKey = false;
+        } else if (c == ',') {
+            expectKey = !open.empty() && open.back() == '{';
+        } else if (c == ':') {
+            expectKey = false;
+        }
+        return true;
+    }
+
+    // Tokenize the text into the streams; false if it is not JSON the tokenizer can split
+    static bool split(const string& json, string streams[STREAM_COUNT]) {
+        const char* data = json.data();
+        size_t n = json.length();
+        unordered_map<string, size_t> keys;
+        vector<char> open;
+        bool expectKey = false;
+
+        for (size_t p = 0; p < n;) {
+            char c = data[p];
+            if (c == '"') {
+                size_t end = scanString(data, n, p + 1);
+                if (end >= n) return false;
+                if (expectKey) {
+                    string key(data + p + 1, end - p - 1);
+                    unordered_map<string, size_t>::iterator it = keys.find(key);
+                    if (it != keys.end()) {
+                        appendVarint(streams[KEYS], it->second);
+                    } else {
+                        appendVarint(streams[KEYS], keys.size());
+                        streams[KEYS].append(data + p + 1, end - p);  // Text and closing quote
+                        keys.emplace(key, keys.size());
+                    }
+                } else {
+                    streams[STRINGS].append(data + p + 1, end - p);
+                }
+                streams[STRUCTURE] += '"';
+                expectKey = false;
+                p = end + 1;
+            } else if (isNumberStart(c)) {
+                size_t end = p;
+                while (end < n && isNumberPart(data[end])) end++;
+                streams[NUMBERS].append(data + p, end - p);
+                streams[NUMBERS] += NUMBER_END;
+                streams[STRUCTURE] += NUMBER_MARK;
+                p = end;
+            } else {
+                if (!isStructural(c) || !track(c, open, expectKey)) return false;
+                streams[STRUCTURE] += c;
+                p++;
+            }
+        }
+        return open.empty() && !streams[STRUCTURE].empty();
+    }
+
+    // Rebuild the text from the streams
+    static bool join(const string streams[STREAM_COUNT], string& json) {
+        vector<string> keys;
+        vector<char> open;
+        bool expectKey = false;
+        size_t keyPos = 0, stringPos = 0, numberPos = 0;
+
+        for (char c : streams[STRUCTURE]) {
+            if (c == '"') {
+                json += '"';
+                if (expectKey) {
+                    size_t id;
+                    if (!readVarint(streams[KEYS], keyPos, id) || id > keys.size()) return false;
+                    if (id == keys.size()) {
+                        const string& s = streams[KEYS];
+                        size_t end = scanString(s.data(), s.length(), keyPos);
+                        if (end >= s.length()) return false;
+                        keys.push_back(s.substr(keyPos, end - keyPos));
+                        keyPos = end + 1;
+                    }
+                    json += keys[id];
+                    json += '"';
+                } else {
+                    const string& s = streams[STRINGS];
+                    size_t end = scanString(s.data(), s.length(), stringPos);
+                    if (end >= s.length()) return false;
+                    json.append(s, stringPos, end - stringPos + 1);
+                    stringPos = end + 1;
+                }
+                expectKey = false;
+            } else if (c == NUMBER_MARK) {
+                size_t end = streams[NUMBERS].find(NUMBER_END, numberPos);
+                if (end == string::npos) return false;
+                json.append(streams[NUMBERS], numberPos, end - numberPos);
+                numberPos = end + 1;
+            } else {
+                if (!track(c, open, expectKey)) return false;
+                json += c;
+            }
+        }
+        return keyPos == streams[KEYS].length() && stringPos == streams[STRINGS].length()
+            && numberPos == streams[NUMBERS].length();
+    }
+
+public:
+    // Encode the text as one mode bit followed by its streams
+    static string encode(const string& input, Mode* used = nullptr) {
+        workloadCapture().record("json", input);
+        string streams[STREAM_COUNT];
+        string bits;
+        Mode mode = split(input, streams) ? SPLIT : SINGLE;
+
+        appendBits(bits, mode, 1);
+        if (mode == SPLIT) {
+            for (const string& stream : streams) appendHuffmanStream(bits, stream);
+        } else {
+            appendHuffmanStream(bits, input);
+        }
+        if (used) *used = mode;
+        return bits;
+    }
+
+    // Decode a string produced by encode(); false if the bits are malformed
+    static bool decode(const string& bits, string& out) {
+        size_t pos = 0;
+        out.clear();
+        if (bits.empty()) return false;
+
+        if (readBits(bits, pos, 1) == SINGLE) {
+            return readHuffmanStream(bits, pos, out) && pos == bits.length();
+        }
+        string streams[STREAM_COUNT];
+        for (string& stream : streams) {
+            if (!readHuffmanStream(bits, pos, stream)) return false;
+        }
+        return pos == bits.length() && join(streams, out);
+    }
+};
+
+// ZeroRunCodec codes mostly-zero binary data the way JPEG codes AC
+// coefficients. Each nonzero byte becomes one symbol (run << 4 | size), where
+// run is the number of zeros before it (0-15) and size the bit length of its
+// value (1-8), followed by the size - 1 value bits below the leading one.
+// ZRL (0xF0) stands for 16 zeros and EOB (0x00) for zeros up to the end. The
+// symbols are one Huffman stream; the value bits follow it uncoded. Input
+// with too few zeros is coded as a single byte stream instead.
+class ZeroRunCodec {
+public:
+    enum Mode { PLAIN = 0, ZERO_RUN = 1 };
+    static constexpr double MIN_ZERO_FRACTION = 0.6;  // Share of zero bytes that selects ZERO_RUN
+
+private:
+    static constexpr unsigned char EOB = 0x00;  // The rest of the input is zero
+    static constexpr unsigned char ZRL = 0xF0;  // Sixteen zeros
+
+    // Index of the first nonzero byte at or after p, or n if there is none
+    static size_t skipZeros(const char* data, size_t n, size_t p) {
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+        while (p + 8 <= n) {
+            uint64_t word;
+            memcpy(&word, data + p, 8);
+            if (word != 0) return p + __builtin_ctzll(word) / 8;
+            p += 8;
+        }
+#endif
+        while (p < n && data[p] == 0) p++;
+        return p;
+    }
+
+public:
+    // Mode encode() picks for the input, from the zero count of its histogram
+    static Mode select(const string& input) {
+        uint32_t hist[256] = {0};
+        countHistogram(input.data(), input.length(), hist);
+        return (!input.empty() && hist[0] >= input.length() * MIN_ZERO_FRACTION) ? ZERO_RUN : PLAIN;
+    }
+
+    // Encode the input in the given mode as one mode bit followed by the data.
+    // ZERO_RUN data is the input length in 32 bits, the symbol stream and the value bits.
+    static string encode(const string& input, Mode mode) {
+        string bits;
+        appendBits(bits, mode, 1);
+        if (mode == PLAIN) {
+            appendHuffmanStream(bits, input);
+            return bits;
+        }
+
+        string symbols, values;
+        const char* data = input.data();
+        size_t n = input.length(), p = 0;
+        while (p < n) {
+            size_t next = skipZeros(data, n, p);
+            if (next == n) {
+                symbols += (char)EOB;
+                break;
+            }
+            size_t run = next - p;
+            for (; run >= 16; run -= 16) symbols += (char)ZRL;
+            unsigned value = (unsigned char)data[next];
+            int size = 32 - __builtin_clz(value);
+            symbols += (char)(run << 4 | size);
+            appendBits(values, value, size - 1);
+            p = next + 1;
+        }
+
+        appendBits(bits, n, 32);
+        appendHuffmanStream(bits, symbols);
+        return bits + values;
+    }
+
+    // Encode the input in the mode select() picks
+    static string encode(const string& input, Mode* used = nullptr) {
+        workloadCapture().record("zero-run", input);
+        Mode mode = select(input);
+        if (used) *used = mode;
+        return encode(input, mode);
+    }
+
+    // Decode a string produced by encode(); false if the bits are malformed
+    static bool decode(const string& bits, string& out) {
+        size_t pos = 0;
+        out.clear();
+        if (bits.empty()) return false;
+
+        if (readBits(bits, pos, 1) == PLAIN) {
+            return readHuffmanStream(bits, pos, out) && pos == bits.length();
+        }
+        if (bits.length() < pos + 32) return false;
+        size_t length = readBits(bits, pos, 32);
+        string symbols;
+        if (length > streamByteLimit() || !readHuffmanStream(bits, pos, symbols)) return false;
+
+        // One memset zero-fills every run, so a run only moves the write position
+        out.assign(length, '\0');
+        char* dst = &out[0];
+        size_t at = 0;
+        for (size_t i = 0; i < symbols.length(); i++) {
+            unsigned char symbol = symbols[i];
+            if (symbol == EOB) return i + 1 == symbols.length() && at < length && pos == bits.length();
+            if (symbol == ZRL) {
+                at += 16;
+                if (at >= length) return false;
+                continue;
+            }
+            size_t run = symbol >> 4;
+            int size = symbol & 15;
+            if (size == 0 || size > 8 || at + run >= length || pos + size - 1 > bits.length()) return false;
+            at += run;
+            dst[at++] = (char)((1u << (size - 1)) | readBits(bits, pos, size - 1));
+        }
+        return at == length && pos == bits.length();
+    }
+};
+
+// LogTemplateCodec learns line templates online, in the style of Drain, and
+// codes each line as a template ID plus the values of its variable slots.
+// Lines are split on single spaces so the text is rebuilt exactly. A token
+// holding a digit or a control byte is a variable. Templates never change
+// once sent: when a line nearly matches one, the positions that differ become
+// wildcards in a new template with a new ID. Each batch of lines has its own
+// templates and streams, so batches are encoded and decoded on separate threads.
+//   ids          template IDs as varints; the next unused ID means a template
+//                definition follows in the definitions stream
+//   definitions  template tokens joined by spaces, wildcards as "\x01", ending with '\n'
+//   slot k       values of the k-th wildcard of each line, each ending with '\n'
+class LogTemplateCodec {
+public:
+    static constexpr size_t BATCH_LINES = 4096;  // Lines per independently coded batch
+    static constexpr int SLOT_STREAMS = 8;  // Wildcards past the last share its stream
+
+private:
+    enum Stream { IDS, DEFINITIONS, FIRST_SLOT, STREAM_COUNT = FIRST_SLOT + SLOT_STREAMS };
+    static constexpr char WILDCARD = '\x01';  // Cannot appear in a constant token
+    static constexpr double MERGE_SIMILARITY = 0.5;  // Share of equal tokens needed to merge
+
+    // Template is the token list of a learned template
+    struct Template {
+        vector<string> tokens;
+        int id;
+    };
+
+    static vector<string> splitOn(const string& text, size_t begin, size_t end, char separator) {
+        vector<string> parts;
+        size_t start = begin;
+        for (size_t i = begin; i <= end; i++) {
+            if (i == end || text[i] == separator) {
+                parts.push_back(text.substr(start, i - start));
+                start = i + 1;
+            }
+        }
+        return parts;
+    }
+
+    static bool isVariable(const string& token) {
+        for (unsigned char c : token) {
+            if ((c >= '0' && c <= '9') || c < 0x20 || c == 0x7F) return true;
+        }
+        return false;
+    }
+
+    // Read the text up to the next '\n' of a stream
+    static bool readField(const string& stream, size_t& pos, string& field) {
+        size_t end = stream.find('\n', pos);
+        if (end == string::npos) return false;
+        field.assign(stream, pos, end - pos);
+        pos = end + 1;
+        return true;
+    }
+
+    // Code one batch of lines into its streams
+    static string encodeBatch(const vector<string>& lines) {
+        string streams[STREAM_COUNT];
+        map<pair<size_t, string>, vector<Template>> groups;  // By token count and first token
+        int nextId = 0;
+
+        for (const string& line : lines) {
+            vector<string> tokens = splitOn(line, 0, line.length(), ' ');
+            vector<bool> variable(tokens.size());
+            for (size_t i = 0; i < tokens.size(); i++) variable[i] = isVariable(tokens[i]);
+
+            vector<Template>& group = groups[make_pair(tokens.size(), variable[0] ? string(1, WILDCARD) : tokens[0])];
+            Template* best = nullptr;
+            size_t bestEqual = 0;
+            bool exact = false;
+            for (Template& candidate : group) {
+                size_t equal = 0;
+                bool covers = true;
+                for (size_t i = 0; i < tokens.size(); i++) {
+                    bool wild = candidate.tokens[i].length() == 1 && candidate.tokens[i][0] == WILDCARD;
+                    if (!wild && candidate.tokens[i] == tokens[i]) equal++;
+                    else if (!wild) covers = false;
+                }
+                if (covers) {
+                    best = &candidate;
+                    exact = true;
+                    break;
+                }
+                if (equal > bestEqual) {
+                    best = &candidate;
+                    bestEqual = equal;
+                }
+            }
+
+            if (!exact) {
+                Template fresh;
+                if (best && bestEqual >= MERGE_SIMILARITY * tokens.size()) {
+                    fresh.tokens = best->tokens;  // Merge: positions that differ become wildcards
+                    for (size_t i = 0; i < tokens.size(); i++) {
+                        if (fresh.tokens[i] != tokens[i]) fresh.tokens[i] = string(1, WILDCARD);
+                    }
+                    fresh.id = nextId++;
+                    *best = fresh;  // The old ID stays valid for lines already sent
+                } else {
+                    fresh.tokens = tokens;
+                    for (size_t i = 0; i < tokens.size(); i++) {
+                        if (variable[i]) fresh.tokens[i] = string(1, WILDCARD);
+                    }
+                    fresh.id = nextId++;
+                    group.push_back(fresh);
+                    best = &group.back();
+                }
+                appendVarint(streams[IDS], fresh.id);
+                for (size_t i = 0; i < fresh.tokens.size(); i++) {
+                    if (i > 0) streams[DEFINITIONS] += ' ';
+                    streams[DEFINITIONS] += fresh.tokens[i];
+                }
+                streams[DEFINITIONS] += '\n';
+            } else {
+                appendVarint(streams[IDS], best->id);
+            }
+
+            int slot = 0;
+            for (size_t i = 0; i < tokens.size(); i++) {
+                if (best->tokens[i].length() != 1 || best->tokens[i][0] != WILDCARD) continue;
+                string& stream = streams[FIRST_SLOT + min(slot++, SLOT_STREAMS - 1)];
+                stream += tokens[i];
+                stream += '\n';
+            }
+        }
+
+        string bits;
+        for (const string& stream : streams) appendHuffmanStream(bits, stream);
+        return bits;
+    }
+
+    // Rebuild the lines of one batch
+    static bool decodeBatch(const string& bits, size_t count, vector<string>& lines) {
+        string streams[STREAM_COUNT];
+        size_t pos = 0;
+        for (string& stream : streams) {
+            if (!readHuffmanStream(bits, pos, stream)) return false;
+        }
+        if (pos != bits.length()) return false;
+
+        vector<vector<string>> templates;
+        size_t idPos = 0, definitionPos = 0;
+        size_t slotPos[SLOT_STREAMS] = {0};
+        string field;
+        for (size_t n = 0; n < count; n++) {
+            size_t id;
+            if (!readVarint(streams[IDS], idPos, id) || id > templates.size()) return false;
+            if (id == templates.size()) {
+                if (!readField(streams[DEFINITIONS], definitionPos, field)) return false;
+                templates.push_back(splitOn(field, 0, field.length(), ' '));
+            }
+
+            string line;
+            int slot = 0;
+            const vector<string>& tokens = templates[id];
+            for (size_t i = 0; i < tokens.size(); i++) {
+                if (i > 0) line += ' ';
+                if (tokens[i].length() == 1 && tokens[i][0] == WILDCARD) {
+                    int k = min(slot++, SLOT_STREAMS - 1);
+                    if (!readField(streams[FIRST_SLOT + k], slotPos[k], field)) return false;
+                    line += field;
+                } else {
+                    line += tokens[i];
+                }
+            }
+            lines.push_back(line);
+        }
+        return idPos == streams[IDS].length() && definitionPos == streams[DEFINITIONS].length();
+    }
+
+    // Run work(batch) for every batch on up to threads threads; one thread
+    // means the calling thread, with nothing spawned
+    static void forEachBatch(size_t batches, int threads, const function<void(size_t)>& work) {
+        threads = max(1, min<int>(threads, (int)batches));
+        if (threads == 1) {
+            for (size_t b = 0; b < batches; b++) work(b);
+            return;
+        }
+        vector<thread> pool;
+        for (int t = 0; t < threads; t++) {
+            pool.emplace_back([&, t]() {
+                for (size_t b = t; b < batches; b += threads) work(b);
+            });
+        }
+        for (thread& worker : pool) worker.join();
+    }
+
+public:
+    // Encode text as a 32-bit line count and batch count, then the bit length
+    // of every batch, then the batches. Batches are coded on up to threads
+    // threads; callers with large inputs opt in to more than one.
+    static string encode(const string& text, int threads = 1) {
+        workloadCapture().record("logs", text);
+        vector<string> lines = splitOn(text, 0, text.length(), '\n');
+        size_t batches = (lines.size() + BATCH_LINES - 1) / BATCH_LINES;
+        vector<string> coded(batches);
+
+        forEachBatch(batches, threads, [&](size_t b) {
+            size_t first = b * BATCH_LINES;
+            vector<string> batch(lines.begin() + first, lines.begin() + min(first + BATCH_LINES, lines.size()));
+            coded[b] = encodeBatch(batch);
+        });
+
+        string bits;
+        appendBits(bits, lines.size(), 32);
+        appendBits(bits, batches, 32);
+        for (const string& batch : coded) appendBits(bits, batch.length(), 32);
+        for (const string& batch : coded) bits += batch;
+        return bits;
+    }
+
+    // Decode a string produced by encode(); false if the bits are malformed
+    static bool decode(const string& bits, string& text, int threads = 1) {
+        size_t pos = 0;
+        text.clear();
+        if (bits.length() < 64) return false;
+        size_t lineCount = readBits(bits, pos, 32);
+        size_t batches = readBits(bits, pos, 32);
+        if (batches != (lineCount + BATCH_LINES - 1) / BATCH_LINES || pos + batches * 32 > bits.length()) return false;
+
+        vector<size_t> offset(batches + 1, pos + batches * 32);
+        for (size_t b = 0; b < batches; b++) offset[b + 1] = offset[b] + readBits(bits, pos, 32);
+        if (offset[batches] != bits.length()) return false;
+
+        vector<vector<string>> decoded(batches);
+        vector<char> ok(batches, 0);
+        forEachBatch(batches, threads, [&](size_t b) {
+            size_t count = min(BATCH_LINES, lineCount - b * BATCH_LINES);
+            ok[b] = decodeBatch(bits.substr(offset[b], offset[b + 1] - offset[b]), count, decoded[b]);
+        });
+
+        for (size_t b = 0; b < batches; b++) {
+            if (!ok[b]) return false;
+            for (size_t i = 0; i < decoded[b].size(); i++) {
+                if (b > 0 || i > 0) text += '\n';
+                text += decoded[b][i];
+            }
+        }
+        return true;
+    }
+};
+
+// BlockArchive is a seekable archive: the input is cut into fixed-size blocks
+// that are coded independently, each with its own table, and packed into
+// bytes, with an index of where every block starts. Any block can be decoded
+// on its own.
+class BlockArchive {
+private:
+    size_t blockSize;  // Decoded size of every block but the last
+    size_t totalSize;  // Decoded size of the whole archive
+    string packed;  // Packed blocks, one after another
+    vector<uint64_t> offsets;  // offsets[k] = start of block k in packed, plus the end
+
+public:
+    BlockArchive() : blockSize(0), totalSize(0), offsets(1, 0) {}
+
+    // Replace the archive with the blocks of data
+    void build(const string& data, size_t blockSize = 1 << 16) {
+        workloadCapture().record("block", data);
+        this->blockSize = max<size_t>(1, blockSize);
+        totalSize = data.length();
+        packed.clear();
+        offsets.assign(1, 0);
+        for (size_t start = 0; start < data.length(); start += this->blockSize) {
+            string bits;
+            appendHuffmanStream(bits, data.substr(start, this->blockSize));
+            packed += packBits(bits);
+            offsets.push_back(packed.length());
+        }
+    }
+
+    size_t getBlockSize() const { return blockSize; }
+    size_t getSize() const { return totalSize; }
+    size_t getPackedSize() const { return packed.length() + offsets.size() * sizeof(uint64_t); }
+    size_t blockCount() const { return offsets.size() - 1; }
+
+    // Decoded size of block k
+    size_t blockLength(size_t k) const { return min(blockSize, totalSize - k * blockSize); }
+
+    // Decode block k into out, which holds at least blockLength(k) bytes
+    bool decodeBlock(size_t k, char* out) const {
+        if (k >= blockCount()) return false;
+        string bits = unpackBits(packed.data() + offsets[k], offsets[k + 1] - offsets[k]);
+        string block;
+        size_t pos = 0;
+        if (!readHuffmanStream(bits, pos, block) || block.length() != blockLength(k)) return false;
+        copy(block.begin(), block.end(), out);
+        return true;
+    }
+
+    // Write the archive as sizes, index and packed blocks
+    bool save(ostream& out) const {
+        uint64_t header[3] = {blockSize, totalSize, offsets.size()};
+        out.write((const char*)header, sizeof(header));
+        out.write((const char*)offsets.data(), offsets.size() * sizeof(uint64_t));
+        out.write(packed.data(), packed.length());
+        return (bool)out;
+    }
+
+    bool save(const string& path) const {
+        ofstream out(path, ios::binary);
+        return save(out);
+    }
+
+    // Read an archive written by save(). The sizes in the header are checked
+    // against the length of the input before anything is allocated, and a
+    // block may not be larger than readHuffmanStream() accepts.
+    bool load(istream& in) {
+        uint64_t header[3];
+        streamoff inputSize = in.seekg(0, ios::end).tellg();
+        in.seekg(0, ios::beg);
+        if (inputSize < (streamoff)sizeof(header) || !in.read((char*)header, sizeof(header))) return false;
+        uint64_t rest = inputSize - sizeof(header);
+        if (header[0] == 0 || header[0] > streamByteLimit()) return false;
+        if (header[2] == 0 || header[2] > rest / sizeof(uint64_t)) return false;
+        if (header[2] - 1 != header[1] / header[0] + (header[1] % header[0] != 0)) return false;
+        rest -= header[2] * sizeof(uint64_t);
+
+        vector<uint64_t> index(header[2]);
+        if (!in.read((char*)index.data(), index.size() * sizeof(uint64_t)) || index[0] != 0) return false;
+        for (size_t k = 1; k < index.size(); k++) {
+            if (index[k] < index[k - 1]) return false;
+        }
+        if (index.back() > rest) return false;
+        string bytes(index.back(), '\0');
+        if (!in.read(&bytes[0], bytes.length())) return false;
+
+        blockSize = header[0];
+        totalSize = header[1];
+        offsets.swap(index);
+        packed.swap(bytes);
+        return true;
+    }
+
+    bool load(const string& path) {
+        ifstream in(path, ios::binary);
+        return load(in);
+    }
+};
+
+// LazyArchiveMapping presents a BlockArchive as one readable memory range whose
+// blocks are decoded on first touch. On Linux the range is registered with
+// userfaultfd: a handler thread receives each missing-page fault, decodes the
+// block holding the page plus 'readahead' following blocks, and copies them in
+// with UFFDIO_COPY. At most cacheBlocks decoded blocks stay resident; older
+// ones are dropped with MADV_DONTNEED and decoded again when touched. Where
+// userfaultfd is unavailable the whole archive is decoded up front.
+// Only faults from user code are served, so do not pass the range to system calls.
+class LazyArchiveMapping {
+private:
+    const BlockArchive& archive;
+    char* base;  // Start of the range
+    size_t span;  // Bytes per block in the range, a multiple of the page size
+    size_t mappedSize;  // Size of the range
+    size_t cacheBlocks;  // Decoded blocks kept resident
+    size_t readahead;  // Blocks decoded after the one that faulted
+    bool lazy;  // Blocks are decoded on first touch
+    vector<char> upfront;  // Storage when decoding everything up front
+    atomic<size_t> blocksDecoded;
+    atomic<bool> failed;  // A block could not be decoded or copied
+
+#ifdef __linux__
+    int uffd;  // userfaultfd descriptor, -1 when not lazy
+    int wake[2];  // Pipe that stops the handler thread
+    thread handler;
+    vector<char> resident;  // Whether each block is currently in the range
+    deque<size_t> residentOrder;  // Resident blocks, oldest first
+    vector<char> scratch;  // One decoded block, padded to span
+
+    // Decode block k and copy it into the range
+    bool populate(size_t k) {
+        fill(scratch.begin(), scratch.end(), 0);
+        if (!archive.decodeBlock(k, scratch.data())) return false;
+        uffdio_copy copyBlock;
+        copyBlock.dst = (unsigned long)(base + k * span);
+        copyBlock.src = (unsigned long)scratch.data();
+        copyBlock.len = span;
+        copyBlock.mode = 0;
+        copyBlock.copy = 0;
+        if (ioctl(uffd, UFFDIO_COPY, &copyBlock) != 0 && errno != EEXIST) return false;
+        resident[k] = 1;
+        residentOrder.push_back(k);
+        blocksDecoded++;
+        return true;
+    }
+
+    // Serve page faults until the pipe is written to
+    void serve() {
+        pollfd fds[2] = {{uffd, POLLIN, 0}, {wake[0], POLLIN, 0}};
+        while (poll(fds, 2, -1) >= 0 || errno == EINTR) {
+            if (fds[1].revents) return;
+            if (!(fds[0].revents & POLLIN)) continue;
+
+            uffd_msg message;
+            if (read(uffd, &message, sizeof(message)) != sizeof(message)) continue;
+            if (message.event != UFFD_EVENT_PAGEFAULT) continue;
+
+            size_t first = (message.arg.pagefault.address - (unsigned long)base) / span;
+            for (size_t k = first; k <= first + readahead && k < archive.blockCount(); k++) {
+                if (resident[k]) continue;
+                if (!populate(k)) {
+                    failed = true;
+                    // Map zeros so the faulting thread does not wait forever
+                    uffdio_zeropage zero = {{(unsigned long)(base + k * span), span}, 0, 0};
+                    ioctl(uffd, UFFDIO_ZEROPAGE, &zero);
+                }
+            }
+            while (residentOrder.size() > cacheBlocks) {
+                size_t oldest = residentOrder.front();
+                residentOrder.pop_front();
+                madvise(base + oldest * span, span, MADV_DONTNEED);
+                resident[oldest] = 0;
+            }
+        }
+    }
+
+    // Map the range and register it with userfaultfd; false if not supported
+    bool startLazy() {
+        long pageSize = sysconf(_SC_PAGESIZE);
+        if (archive.getBlockSize() % pageSize != 0 || archive.blockCount() == 0) return false;
+
+        uffd = syscall(SYS_userfaultfd, O_CLOEXEC | O_NONBLOCK | UFFD_USER_MODE_ONLY);
+        if (uffd < 0) uffd = syscall(SYS_userfaultfd, O_CLOEXEC | O_NONBLOCK);
+        if (uffd < 0) return false;
+
+        uffdio_api api = {UFFD_API, 0, 0};
+        void* range = mmap(nullptr, mappedSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        uffdio_register registration = {{(unsigned long)range, mappedSize}, UFFDIO_REGISTER_MODE_MISSING, 0};
+        if (ioctl(uffd, UFFDIO_API, &api) != 0 || range == MAP_FAILED
+            || ioctl(uffd, UFFDIO_REGISTER, &registration) != 0 || pipe(wake) != 0) {
+            if (range != MAP_FAILED) munmap(range, mappedSize);
+            close(uffd);
+            uffd = -1;
+            return false;
+        }
+
+        base = (char*)range;
+        resident.assign(archive.blockCount(), 0);
+        scratch.resize(span);
+        handler = thread(&LazyArchiveMapping::serve, this);
+        return true;
+    }
+#endif
+
+public:
+    LazyArchiveMapping(const BlockArchive& archive, size_t cacheBlocks = 64, size_t readahead = 1)
+        : archive(archive), blocksDecoded(0), failed(false) {
+        span = archive.getBlockSize();
+        mappedSize = archive.blockCount() * span;
+        this->readahead = readahead;
+        this->cacheBlocks = max(cacheBlocks, readahead + 1);  // Never drop the block that just faulted
+        lazy = false;
+        base = nullptr;
+#ifdef __linux__
+        uffd = -1;
+        lazy = startLazy();
+#endif
+        if (!lazy) {
+            upfront.resize(archive.getSize());
+            for (size_t k = 0; k < archive.blockCount(); k++) {
+                failed = failed || !archive.decodeBlock(k, upfront.data() + k * span);
+                blocksDecoded++;
+            }
+            base = upfront.data();
+        }
+    }
+
+    ~LazyArchiveMapping() {
+#ifdef __linux__
+        if (lazy) {
+            char stop = 1;
+            while (write(wake[1], &stop, 1) < 0 && errno == EINTR) {}
+            handler.join();
+            close(wake[0]);
+            close(wake[1]);
+            close(uffd);
+            munmap(base, mappedSize);
+        }
+#endif
+    }
+
+    LazyArchiveMapping(const LazyArchiveMapping&) = delete;
+    LazyArchiveMapping& operator=(const LazyArchiveMapping&) = delete;
+
+    const char* data() { return base; }
+    size_t size() { return archive.getSize(); }
+    bool isLazy() { return lazy; }
+    bool hasFailed() { return failed; }
+    size_t getBlocksDecoded() { return blocksDecoded; }
+};
+
+// DeltaInstruction inserts literal bytes, then copies a range of the reference
+struct DeltaInstruction {
+    size_t insert;  // Literal bytes taken from the patch
+    size_t copy;  // Bytes copied from the reference
+    size_t offset;  // Start of the copy in the reference
+};
+
+// DeltaPatch is a decoded patch, ready to be applied to its reference
+struct DeltaPatch {
+    size_t targetLength;  // Size of the file the patch rebuilds
+    vector<DeltaInstruction> instructions;
+    string literals;  // Inserted bytes of all instructions, in order
+};
+
+// DeltaCodec describes a target file as copies from a reference file plus
+// inserted literals. The reference is indexed by a rolling hash of every
+// WINDOW-byte block; the target is scanned one byte at a time, and a hit is
+// verified and extended both ways. The patch holds three streams, each coded
+// with its own Huffman table:
+//   commands  insert and copy lengths as varints
+//   offsets   distance of each copy from the end of the previous one, zigzag varints
+//   literals  the inserted bytes
+// Applying a patch only copies memory, so it runs at memcpy speed once the
+// small command streams are decoded.
+class DeltaCodec {
+public:
+    static constexpr size_t WINDOW = 16;  // Shortest match, and the stride of the reference index
+
+private:
+    static constexpr uint64_t BASE = 0x100000001B3ULL;  // Multiplier of the rolling hash
+
+    static uint64_t hashWindow(const char* data) {
+        uint64_t h = 0;
+        for (size_t i = 0; i < WINDOW; i++) h = h * BASE + (unsigned char)data[i];
+        return h;
+    }
+
+    static size_t zigzag(long long value) { return ((unsigned long long)value << 1) ^ (unsigned long long)(value >> 63); }
+    static long long unzigzag(size_t value) { return (long long)(value >> 1) ^ -(long long)(value & 1); }
+
+public:
+    // Build a patch that turns reference into target
+    static string diff(const string& reference, const string& target) {
+        workloadCapture().record("delta", target);
+        // Index the reference: slot -> position + 1 of the first block with that hash
+        size_t blocks = reference.length() / WINDOW;
+        int shift = 63;
+        size_t slotCount = 2;
+        while (slotCount < blocks * 2) {
+            slotCount <<= 1;
+            shift--;
+        }
+        vector<size_t> index(slotCount, 0);
+        for (size_t b = 0; b < blocks; b++) {
+            size_t slot = (hashWindow(reference.data() + b * WINDOW) * 0x9E3779B97F4A7C15ULL) >> shift;
+            if (index[slot] == 0) index[slot] = b * WINDOW + 1;
+        }
+
+        uint64_t outFactor = 1;  // BASE^(WINDOW-1), to remove the byte leaving the window
+        for (size_t i = 1; i < WINDOW; i++) outFactor *= BASE;
+
+        string commands, offsets, literals;
+        size_t literalStart = 0, lastCopyEnd = 0;
+        size_t p = 0;
+        uint64_t h = (target.length() >= WINDOW) ? hashWindow(target.data()) : 0;
+
+        while (blocks > 0 && p + WINDOW <= target.length()) {
+            size_t slot = (h * 0x9E3779B97F4A7C15ULL) >> shift;
+            size_t candidate = index[slot];
+            if (candidate && reference.compare(candidate - 1, WINDOW, target, p, WINDOW) == 0) {
+                size_t refPos = candidate - 1, start = p;
+                while (start > literalStart && refPos > 0 && reference[refPos - 1] == target[start - 1]) {
+                    start--;
+                    refPos--;
+                }
+                size_t end = p + WINDOW, refEnd = refPos + (end - start);
+                while (end < target.length() && refEnd < reference.length() && reference[refEnd] == target[end]) {
+                    end++;
+                    refEnd++;
+                }
+
+                appendVarint(commands, start - literalStart);
+                appendVarint(commands, end - start);
+                appendVarint(offsets, zigzag((long long)refPos - (long long)lastCopyEnd));
+                literals.append(target, literalStart, start - literalStart);
+                lastCopyEnd = refEnd;
+                literalStart = p = end;
+                if (p + WINDOW <= target.length()) h = hashWindow(target.data() + p);
+                continue;
+            }
+            if (p + WINDOW < target.length()) {
+                h = (h - (unsigned char)target[p] * outFactor) * BASE + (unsigned char)target[p + WINDOW];
+            }
+            p++;
+        }
+
+        // Trailing literals, with no copy after them
+        appendVarint(commands, target.length() - literalStart);
+        appendVarint(commands, 0);
+        appendVarint(offsets, 0);
+        literals.append(target, literalStart, string::npos);
+
+        string bits;
+        appendBits(bits, target.length() >> 32, 32);
+        appendBits(bits, target.length() & 0xFFFFFFFFUL, 32);
+        appendHuffmanStream(bits, commands);
+        appendHuffmanStream(bits, offsets);
+        appendHuffmanStream(bits, literals);
+        return bits;
+    }
+
+    // Largest target parse() accepts. Copies may repeat, so without a limit a
+    // patch of a few bytes could ask for a target of any size.
+    static size_t& targetLimit() {
+        static size_t limit = (size_t)1 << 30;
+        return limit;
+    }
+
+    // Decode a patch and check it only copies from inside a reference of the
+    // given size and rebuilds exactly targetLength <= targetLimit() bytes
+    static bool parse(const string& bits, size_t referenceLength, DeltaPatch& patch) {
+        size_t pos = 0;
+        if (bits.length() < 64) return false;
+        patch.targetLength = readBits(bits, pos, 32) << 32;
+        patch.targetLength |= readBits(bits, pos, 32);
+        if (patch.targetLength > targetLimit()) return false;
+
+        string commands, offsets;
+        if (!readHuffmanStream(bits, pos, commands) || !readHuffmanStream(bits, pos, offsets)
+            || !readHuffmanStream(bits, pos, patch.literals) || pos != bits.length()) {
+            return false;
+        }
+
+        patch.instructions.clear();
+        size_t commandPos = 0, offsetPos = 0, lastCopyEnd = 0, literalTotal = 0, produced = 0;
+        while (commandPos < commands.length()) {
+            DeltaInstruction instruction;
+            size_t distance;
+            if (!readVarint(commands, commandPos, instruction.insert) || !readVarint(commands, commandPos, instruction.copy)
+                || !readVarint(offsets, offsetPos, distance)) {
+                return false;
+            }
+            long long offset = (long long)lastCopyEnd + unzigzag(distance);
+            if (offset < 0 || (size_t)offset > referenceLength || instruction.copy > referenceLength - offset) return false;
+            // Checked against what is left, so no sum can wrap around
+            if (instruction.insert > patch.literals.length() - literalTotal
+                || instruction.insert > patch.targetLength - produced
+                || instruction.copy > patch.targetLength - produced - instruction.insert) {
+                return false;
+            }
+            instruction.offset = offset;
+            lastCopyEnd = offset + instruction.copy;
+            literalTotal += instruction.insert;
+            produced += instruction.insert + instruction.copy;
+            patch.instructions.push_back(instruction);
+        }
+        return offsetPos == offsets.length() && literalTotal == patch.literals.length() && produced == patch.targetLength;
+    }
+
+    // Stream the target to sink as literal runs and reference ranges, without
+    // building it in memory. The patch must come from parse() with this reference.
+    static void apply(const DeltaPatch& patch, const char* reference, const function<void(const char*, size_t)>& sink) {
+        const char* literal = patch.literals.data();
+        for (const DeltaInstruction& instruction : patch.instructions) {
+            if (instruction.insert) sink(literal, instruction.insert);
+            literal += instruction.insert;
+            if (instruction.copy) sink(reference + instruction.offset, instruction.copy);
+        }
+    }
+
+    // Write the target into out, which holds patch.targetLength bytes
+    static void apply(const DeltaPatch& patch, const char* reference, char* out) {
+        const char* literal = patch.literals.data();
+        for (const DeltaInstruction& instruction : patch.instructions) {
+            memcpy(out, literal, instruction.insert);
+            out += instruction.insert;
+            literal += instruction.insert;
+            memcpy(out, reference + instruction.offset, instruction.copy);
+            out += instruction.copy;
+        }
+    }
+
+    // Rebuild the target from a patch; false if the patch is malformed or
+    // does not fit the reference
+    static bool patch(const string& reference, const string& bits, string& target) {
+        DeltaPatch parsed;
+        if (!parse(bits, reference.length(), parsed)) return false;
+        target.resize(parsed.targetLength);
+        apply(parsed, reference.data(), &target[0]);
+        return true;
+    }
+};
+
+// CodeQualityReport summarizes how well the Huffman codes fit one block of input
+struct CodeQualityReport {
+    double entropy;  // Shannon entropy of the block in bits per character
+    double averageLength;  // Average code length in bits per character
+    double redundancy;  // averageLength - entropy, the bits wasted per character
+    double kraftSum;  // Sum of 2^-length over all codes, 1.0 for a complete code
+    int maxDepth;  // Length of the longest code
+    double meanDepth;  // Unweighted mean code length over the distinct characters
+    vector<int> lengthHistogram;  // lengthHistogram[L] = number of codes of length L
+    size_t decodeTableSize;  // Size of the decode table in bytes
+};
+
+// Analyze the codes generated for the block held in the frequency table.
+// Only the distinct characters are visited, so the cost does not depend on the block length.
+CodeQualityReport analyzeCodes(FrequencyTable& table, HuffmanTree& tree, const unordered_map<char, string>& codes) {
+    CodeQualityReport report = {0.0, 0.0, 0.0, 0.0, 0, 0.0, vector<int>(), tree.getDecodeTableSize()};
+    int totalFreq = 0;
+    int distinct = 0;
+
+    for (Node* p = table.getHead(); p != nullptr; p = p->getNext()) {
+        totalFreq += p->getFreq();
+    }
+    if (totalFreq == 0) return report;
+
+    for (Node* p = table.getHead(); p != nullptr; p = p->getNext()) {
+        unordered_map<char, string>::const_iterator it = codes.find(p->getChar());
+        int length = (it == codes.end()) ? 0 : it->second.length();
+        double probability = (double)p->getFreq() / totalFreq;
+
+        report.entropy -= probability * log2(probability);
+        report.averageLength += probability * length;
+        report.kraftSum += ldexp(1.0, -length);
+        report.maxDepth = max(report.maxDepth, length);
+        report.meanDepth += length;
+
+        if ((int)report.lengthHistogram.size() <= length) {
+            report.lengthHistogram.resize(length + 1, 0);
+        }
+        report.lengthHistogram[length]++;
+        distinct++;
+    }
+
+    report.meanDepth /= distinct;
+    report.redundancy = report.averageLength - report.entropy;
+    return report;
+}
+
+// Display a code quality report in the same tabular style as the other steps
+void DisplayReport(const CodeQualityReport& report) {
+    cout << fixed << setprecision(4);
+    cout << left << setw(25) << "Entropy (bits/char)" << report.entropy << endl;
+    cout << left << setw(25) << "Avg Code Length" << report.averageLength << endl;
+    cout << left << setw(25) << "Redundancy" << report.redundancy << endl;
+    cout << left << setw(25) << "Kraft Sum" << report.kraftSum << endl;
+    cout << left << setw(25) << "Max Code Depth" << report.maxDepth << endl;
+    cout << left << setw(25) << "Mean Code Depth" << report.meanDepth << endl;
+    cout << left << setw(25) << "Decode Table (bytes)" << report.decodeTableSize << endl;
+    cout.unsetf(ios::fixed);
+    cout << setprecision(6);
+
+    cout << "\n" << left << setw(15) << "Code Length" << setw(15) << "Codes" << endl;
+    cout << string(30, '-') << endl;
+    for (size_t length = 0; length < report.lengthHistogram.size(); length++) {
+        if (report.lengthHistogram[length] > 0) {
+            cout << left << setw(15) << length << setw(15) << report.lengthHistogram[length] << endl;
+        }
+    }
+    cout << string(30, '-') << endl;
+}
+
+// Measure encode throughput of reader threads while a writer keeps swapping the
+// current codebook, once through the lock-free registry and once through a
+// registry-shaped baseline guarded by a mutex. With no read-side contention the
+// per-thread rate of the epoch version stays flat as readers are added.
+void benchHotSwap(int maxReaders, int milliseconds) {
+    const string message = "GET /index.html HTTP/1.1 Host: example.com User-Agent: bench";
+    vector<string> samples = {message, "POST /api/v1/items HTTP/1.1 Content-Type: application/json"};
+
+    cout << left << setw(10) << "Readers" << setw(22) << "Epoch ops/s/thread"
+         << setw(22) << "Mutex ops/s/thread" << setw(12) << "Swaps" << endl;
+    cout << string(66, '-') << endl;
+
+    for (int readers = 1; readers <= maxReaders; readers *= 2) {
+        double rate[2];
+        int swaps = 0;
+
+        for (int mode = 0; mode < 2; mode++) {
+            CodebookRegistry registry;
+            mutex baselineLock;
+            CodeTable* baseline = CodeTable::train(0, samples);
+            atomic<bool> running(true);
+            atomic<unsigned long long> total(0);
+            vector<thread> threads;
+
+            registry.publish(samples);
+
+            for (int r = 0; r < readers; r++) {
+                threads.push_back(thread([&, mode] {
+                    unsigned long long ops = 0;
+                    size_t bits = 0;
+                    while (running.load(memory_order_relaxed)) {
+                        if (mode == 0) {
+                            bits += registry.encode(message).length();
+                        } else {
+                            lock_guard<mutex> guard(baselineLock);
+                            bits += baseline->encode(message).length();
+                        }
+                        ops++;
+                    }
+                    total += ops + (bits == 0);
+                }));
+            }
+
+            // Writer: publish a fresh codebook every millisecond and retire the previous one
+            swaps = 0;
+            chrono::steady_clock::time_point end = chrono::steady_clock::now() + chrono::milliseconds(milliseconds);
+            while (chrono::steady_clock::now() < end) {
+                this_thread::sleep_for(chrono::milliseconds(1));
+                if (mode == 0) {
+                    int id = registry.publish(samples);
+                    registry.retire(id - 1);
+                } else {
+                    CodeTable* next = CodeTable::train(0, samples);
+                    lock_guard<mutex> guard(baselineLock);
+                    delete baseline;
+                    baseline = next;
+                }
+                swaps++;
+            }
+
+            running = false;
+            for (thread& t : threads) t.join();
+            delete baseline;
+            rate[mode] = total * 1000.0 / milliseconds / readers;
+        }
+
+        cout << left << setw(10) << readers << setw(22) << (unsigned long long)rate[0]
+             << setw(22) << (unsigned long long)rate[1] << setw(12) << swaps << endl;
+    }
+    cout << string(66, '-') << endl;
+    cout << "Retired tables still pending: " << EpochManager::global().pendingCount() << endl;
+}
+
+// Time push/pop workloads on DaryHeap, std::priority_queue and the original
+// PriorityQueue class: random keys, then the Huffman merge pattern on 256 leaves.
+void benchHeap(int n, int rounds) {
+    mt19937 rng(12345);
+    vector<int> keys(n);
+    for (int& key : keys) key = rng() % 1000000;
+
+    vector<HuffmanNode> nodes;
+    nodes.reserve(n);
+    for (int i = 0; i < n; i++) nodes.push_back(HuffmanNode((char)i, keys[i]));
+
+    typedef chrono::steady_clock clock;
+    long long checksum = 0;
+
+    auto timeIt = [&](const string& name, const function<void()>& body) {
+        clock::time_point start = clock::now();
+        for (int r = 0; r < rounds; r++) body();
+        double ns = chrono::duration<double, nano>(clock::now() - start).count() / rounds / n;
+        cout << left << setw(34) << name << fixed << setprecision(2) << ns << " ns/element" << endl;
+        cout.unsetf(ios::fixed);
+    };
+
+    cout << "Push " << n << " random keys, then pop them all\n" << string(50, '-') << endl;
+    timeIt("DaryHeap<int, 4>", [&] {
+        DaryHeap<int, 4> heap;
+        heap.reserve(n);
+        for (int i = 0; i < n; i++) heap.push(keys[i], i);
+        while (!heap.isEmpty()) checksum += heap.pop().key;
+    });
+    timeIt("DaryHeap<int, 2>", [&] {
+        DaryHeap<int, 2> heap;
+        heap.reserve(n);
+        for (int i = 0; i < n; i++) heap.push(keys[i], i);
+        while (!heap.isEmpty()) checksum += heap.pop().key;
+    });
+    timeIt("DaryHeap<int, 4> heapify", [&] {
+        vector<DaryHeap<int, 4>::Entry> entries(n);
+        for (int i = 0; i < n; i++) entries[i] = {keys[i], i};
+        DaryHeap<int, 4> heap(entries);
+        while (!heap.isEmpty()) checksum += heap.pop().key;
+    });
+    timeIt("std::priority_queue<pair>", [&] {
+        priority_queue<pair<int, int>, vector<pair<int, int>>, greater<pair<int, int>>> heap;
+        for (int i = 0; i < n; i++) heap.push(make_pair(keys[i], i));
+        while (!heap.empty()) {
+            checksum += heap.top().first;
+            heap.pop();
+        }
+    });
+    timeIt("PriorityQueue (HuffmanNode*)", [&] {
+        PriorityQueue heap;
+        for (int i = 0; i < n; i++) heap.push(&nodes[i]);
+        while (!heap.isEmpty()) checksum += heap.pop()->freq;
+    });
+
+    // Huffman merge pattern: pop two, push their sum, on a 256-symbol alphabet
+    const int leaves = 256;
+    cout << "\nHuffman merges on " << leaves << " leaves\n" << string(50, '-') << endl;
+    int savedN = n;
+    n = leaves;
+    timeIt("DaryHeap<int, 4>", [&] {
+        vector<DaryHeap<int, 4>::Entry> entries(leaves);
+        for (int i = 0; i < leaves; i++) entries[i] = {keys[i] + 1, i};
+        DaryHeap<int, 4> heap(entries);
+        int next = leaves;
+        while (heap.size() > 1) {
+            int a = heap.pop().key;
+            int b = heap.pop().key;
+            heap.push(a + b, next++);
+        }
+        checksum += heap.top().key;
+    });
+    timeIt("std::priority_queue<pair>", [&] {
+        priority_queue<pair<int, int>, vector<pair<int, int>>, greater<pair<int, int>>> heap;
+        for (int i = 0; i < leaves; i++) heap.push(make_pair(keys[i] + 1, i));
+        int next = leaves;
+        while (heap.size() > 1) {
+            int a = heap.top().first;
+            heap.pop();
+            int b = heap.top().first;
+            heap.pop();
+            heap.push(make_pair(a + b, next++));
+        }
+        checksum += heap.top().first;
+    });
+    timeIt("PriorityQueue (HuffmanNode*)", [&] {
+        vector<HuffmanNode> merged;
+        merged.reserve(leaves);
+        PriorityQueue heap;
+        for (int i = 0; i < leaves; i++) heap.push(&nodes[i]);
+        while (heap.queue.size() > 1) {
+            HuffmanNode* a = heap.pop();
+            HuffmanNode* b = heap.pop();
+            merged.push_back(HuffmanNode('\0', a->freq + b->freq));
+            heap.push(&merged.back());
+        }
+        checksum += heap.pop()->freq;
+    });
+    n = savedN;
+
+    cout << "\n(checksum " << checksum << ")" << endl;
+}
+
+// Replay a synthetic log stream through each flush policy on a virtual clock
+// and report the wait of the oldest byte against the compression ratio
+void benchFlush(int lines, int intervalMicros) {
+    struct Policy {
+        string name;
+        FlushPolicy policy;
+        bool flushEachLine;  // Explicit flush after every line
+    };
+    vector<Policy> policies = {
+        {"block only (64 KiB)", {0, 0}, false},
+        {"max 4096 bytes", {4096, 0}, false},
+        {"max 512 bytes", {512, 0}, false},
+        {"max 100 ms", {0, 100}, false},
+        {"max 10 ms", {0, 10}, false},
+        {"max 1024 bytes / 10 ms", {1024, 10}, false},
+        {"explicit flush per line", {0, 0}, true},
+    };
+
+    mt19937 rng(7);
+    vector<string> stream;
+    const char* levels[] = {"INFO", "WARN", "DEBUG", "ERROR"};
+    for (int i = 0; i < lines; i++) {
+        stringstream line;
+        line << "2026-10-18T12:" << setw(2) << setfill('0') << (i / 60000) % 60 << ":" << setw(2) << (i / 1000) % 60
+             << setfill(' ') << " " << levels[rng() % 4] << " worker-" << rng() % 16 << " served /api/items/"
+             << rng() % 100000 << " in " << rng() % 500 << " ms\n";
+        stream.push_back(line.str());
+    }
+
+    cout << left << setw(26) << "Policy" << setw(10) << "Frames" << setw(12) << "Ratio %"
+         << setw(12) << "Header %" << setw(14) << "Avg wait ms" << setw(14) << "Max wait ms" << endl;
+    cout << string(88, '-') << endl;
+
+    for (const Policy& p : policies) {
+        StreamingEncoder encoder(p.policy);
+        StreamingDecoder decoder;
+        chrono::steady_clock::time_point now;
+        string decoded, original;
+
+        for (const string& line : stream) {
+            now += chrono::microseconds(intervalMicros);
+            encoder.write(line, now);
+            if (p.flushEachLine) encoder.flush(now);
+            original += line;
+            decoded += decoder.feed(encoder.takeOutput());
+        }
+        now += chrono::microseconds(intervalMicros);
+        encoder.flush(now);
+        decoded += decoder.feed(encoder.takeOutput());
+
+        const FlushStats& st = encoder.getStats();
+        cout << left << setw(26) << p.name << setw(10) << st.frames << fixed << setprecision(2)
+             << setw(12) << (double)st.outputBits / (st.inputBytes * 8) * 100
+             << setw(12) << (double)st.headerBits / st.outputBits * 100
+             << setw(14) << st.totalWaitMillis / max<size_t>(st.frames, 1)
+             << setw(14) << st.maxWaitMillis << (decoded == original ? "" : "  round trip FAILED") << endl;
+        cout.unsetf(ios::fixed);
+    }
+    cout << string(88, '-') << endl;
+}
+
+// Build code lengths for many small blocks with the per-block tree builder,
+// with buildCodeLengths and with buildCodeLengthsBatch, and check they agree
+int benchBatch(int blocks, int blockSize) {
+    mt19937 rng(99);
+    vector<vector<uint32_t>> histograms(blocks, vector<uint32_t>(256, 0));
+    vector<const uint32_t*> pointers;
+
+    for (vector<uint32_t>& histogram : histograms) {
+        // Skewed alphabets of varying size, like short text and binary records
+        int alphabet = 2 + rng() % 254;
+        for (int i = 0; i < blockSize; i++) {
+            int c = (int)(alphabet * pow(uniform_real_distribution<double>(0.0, 1.0)(rng), 2.0));
+            histogram[min(c, alphabet - 1)]++;
+        }
+        pointers.push_back(histogram.data());
+    }
+
+    typedef chrono::steady_clock clock;
+    vector<array<unsigned char, 256>> treeLengths(blocks), scalarLengths(blocks), batchLengths;
+
+    clock::time_point start = clock::now();
+    for (int b = 0; b < blocks; b++) {
+        FrequencyTable table;
+        for (int c = 0; c < 256; c++) {
+            if (histograms[b][c] > 0) table.AddFrequency((char)c, histograms[b][c]);
+        }
+        HuffmanTree tree;
+        tree.buildTree(table);
+        unordered_map<char, string> codes = tree.generateCodes();
+        treeLengths[b].fill(0);
+        for (const pair<const char, string>& p : codes) treeLengths[b][(unsigned char)p.first] = p.second.length();
+    }
+    double treeTime = chrono::duration<double, micro>(clock::now() - start).count();
+
+    start = clock::now();
+    for (int b = 0; b < blocks; b++) buildCodeLengths(pointers[b], scalarLengths[b].data());
+    double scalarTime = chrono::duration<double, micro>(clock::now() - start).count();
+
+    // The batch builder once per merge kernel, each checked against buildCodeLengths
+    vector<pair<string, MergeKernel>> kernels = availableMergeKernels();
+    vector<double> batchTimes;
+    int mismatches = 0;
+    for (const pair<string, MergeKernel>& kernel : kernels) {
+        start = clock::now();
+        buildCodeLengthsBatch(pointers, batchLengths, kernel.second);
+        batchTimes.push_back(chrono::duration<double, micro>(clock::now() - start).count());
+        for (int b = 0; b < blocks; b++) mismatches += scalarLengths[b] != batchLengths[b];
+    }
+    for (int b = 0; b < blocks; b++) mismatches += treeLengths[b] != scalarLengths[b];
+
+    cout << left << setw(30) << "Builder" << "us/block" << endl;
+    cout << string(40, '-') << endl;
+    cout << fixed << setprecision(3);
+    cout << left << setw(30) << "buildTree + generateCodes" << treeTime / blocks << endl;
+    cout << left << setw(30) << "buildCodeLengths" << scalarTime / blocks << endl;
+    for (size_t k = 0; k < kernels.size(); k++) {
+        cout << left << setw(30) << "buildCodeLengthsBatch " + kernels[k].first << batchTimes[k] / blocks << endl;
+    }
+    cout.unsetf(ios::fixed);
+    cout << string(40, '-') << endl;
+    cout << "Results with different lengths: " << mismatches << endl;
+    return mismatches == 0 ? 0 : 1;
+}
+
+// Measure per-message latency of the tiny-message path against the full
+// FrequencyTable -> buildTree -> generateCodes -> encode flow and against
+// TinyCodec::TARGET_P99_NS
+int benchTiny(int messages) {
+    mt19937 rng(31);
+    const char* words[] = {"id", "ok", "user", "GET", "200", "true", "name", "error", "ms", "/api"};
+    vector<string> inputs;
+    for (int i = 0; i < messages; i++) {
+        string message;
+        size_t length = 1 + rng() % TinyCodec::MAX_INPUT;
+        int kind = rng() % 3;
+        while (message.length() < length) {
+            if (kind == 0) message += string(words[rng() % 10]) + ((rng() % 3) ? " " : "=");
+            else if (kind == 1) message += (char)('0' + rng() % 10);
+            else message += (char)(rng() % 256);
+        }
+        message.resize(length);
+        inputs.push_back(message);
+    }
+
+    typedef chrono::steady_clock clock;
+    vector<double> encodeNs, decodeNs;
+    uint8_t packed[TinyCodec::MAX_OUTPUT];
+    char decoded[TinyCodec::MAX_INPUT];
+    size_t inputBytes = 0, outputBytes = 0;
+    int failures = 0;
+    int modes[3] = {0, 0, 0};
+
+    TinyCodec::staticCode();  // Build the static codebook outside the timed loop
+    for (const string& message : inputs) {
+        clock::time_point start = clock::now();
+        size_t size = TinyCodec::encode(message.data(), message.length(), packed);
+        clock::time_point middle = clock::now();
+        int length = TinyCodec::decode(packed, size, decoded);
+        clock::time_point end = clock::now();
+
+        encodeNs.push_back(chrono::duration<double, nano>(middle - start).count());
+        decodeNs.push_back(chrono::duration<double, nano>(end - middle).count());
+        failures += (length != (int)message.length()) || string(decoded, max(length, 0)) != message;
+        modes[packed[0] >> 6]++;
+        inputBytes += message.length();
+        outputBytes += size;
+    }
+
+    clock::time_point start = clock::now();
+    size_t fullBits = 0;
+    for (const string& message : inputs) {
+        FrequencyTable table;
+        HuffmanTree tree;
+        table.sethuffmanString(message);
+        table.MakeTable();
+        tree.buildTree(table);
+        unordered_map<char, string> codes = tree.generateCodes();
+        fullBits += tree.encode(message, codes).length();
+    }
+    double fullNs = chrono::duration<double, nano>(clock::now() - start).count() / messages;
+
+    sort(encodeNs.begin(), encodeNs.end());
+    sort(decodeNs.begin(), decodeNs.end());
+    auto percentile = [](const vector<double>& v, double p) { return v[min(v.size() - 1, (size_t)(p * v.size()))]; };
+
+    cout << fixed << setprecision(1);
+    cout << left << setw(22) << "" << setw(12) << "p50 ns" << setw(12) << "p99 ns" << endl;
+    cout << string(46, '-') << endl;
+    cout << left << setw(22) << "TinyCodec::encode" << setw(12) << percentile(encodeNs, 0.5) << setw(12) << percentile(encodeNs, 0.99) << endl;
+    cout << left << setw(22) << "TinyCodec::decode" << setw(12) << percentile(decodeNs, 0.5) << setw(12) << percentile(decodeNs, 0.99) << endl;
+    cout << string(46, '-') << endl;
+    cout << "Full flow mean: " << fullNs << " ns (codes only, no table sent: " << (double)fullBits / (inputBytes * 8) * 100 << "%)\n";
+    double worstP99 = max(percentile(encodeNs, 0.99), percentile(decodeNs, 0.99));
+    cout << "p99 target: " << TinyCodec::TARGET_P99_NS << " ns, "
+         << (worstP99 <= TinyCodec::TARGET_P99_NS ? "met" : "missed by " + to_string((int)(worstP99 / TinyCodec::TARGET_P99_NS)) + "x") << "\n";
+    cout << "Tiny path ratio: " << (double)outputBytes / inputBytes * 100 << "%\n";
+    cout.unsetf(ios::fixed);
+    cout << "Modes: stored " << modes[TinyCodec::STORED] << ", static " << modes[TinyCodec::STATIC]
+         << ", dynamic " << modes[TinyCodec::DYNAMIC] << endl;
+    cout << "Round trip failures: " << failures << endl;
+    return failures == 0 ? 0 : 1;
+}
+
+// Synthetic text for the benches: characters of a log-like alphabet drawn
+// with probability falling off with their rank, more steeply as skew grows
+string skewedText(size_t n, mt19937& rng, int skew = 2) {
+    const string alphabet = " etaoinshrdlucmfwypvbgkjqxz0123456789.,:/=\n";
+    string text(n, ' ');
+    for (char& c : text) {
+        double u = pow(uniform_real_distribution<double>(0.0, 1.0)(rng), skew);
+        c = alphabet[min((size_t)(alphabet.length() * u), alphabet.length() - 1)];
+    }
+    return text;
+}
+
+// Print the verdict a bench ends with and turn it into the exit code
+int roundTripVerdict(bool ok) {
+    cout << "Round trips: " << (ok ? "ok" : "FAILED") << endl;
+    return ok ? 0 : 1;
+}
+
+// Compare the histogram kernels on uniform, skewed and single-byte data and
+// print the fastest one for this CPU
+void benchHistogram(int megabytes) {
+    size_t n = (size_t)megabytes << 20;
+    mt19937 rng(17);
+    vector<pair<string, string>> corpora(3);
+
+    corpora[0].first = "uniform";
+    corpora[0].second.resize(n);
+    for (char& c : corpora[0].second) c = (char)(rng() & 0xFF);
+
+    // Zipf-like text: a few characters dominate, as in logs and prose
+    corpora[1].first = "skewed";
+    corpora[1].second = skewedText(n, rng, 3);
+
+    corpora[2].first = "single byte";
+    corpora[2].second.assign(n, 'a');
+
+    vector<pair<string, HistogramKernel>> kernels = availableHistogramKernels();
+
+    cout << left << setw(14) << "Corpus";
+    for (const pair<string, HistogramKernel>& k : kernels) cout << setw(18) << k.first;
+    cout << "MB/s" << endl << string(14 + 18 * kernels.size() + 4, '-') << endl;
+
+    vector<double> total(kernels.size(), 0.0);
+    for (const pair<string, string>& corpus : corpora) {
+        vector<uint32_t> reference(256, 0);
+        histogramScalar((const unsigned char*)corpus.second.data(), n, reference.data());
+
+        cout << left << setw(14) << corpus.first;
+        for (size_t k = 0; k < kernels.size(); k++) {
+            vector<uint32_t> hist(256, 0);
+            chrono::steady_clock::time_point start = chrono::steady_clock::now();
+            kernels[k].second((const unsigned char*)corpus.second.data(), n, hist.data());
+            double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+            double rate = megabytes / seconds;
+            total[k] += seconds;
+            cout << setw(18) << ((hist == reference) ? to_string((int)rate) : string("WRONG"));
+        }
+        cout << endl;
+    }
+
+    size_t best = min_element(total.begin(), total.end()) - total.begin();
+    cout << string(14 + 18 * kernels.size() + 4, '-') << endl;
+    cout << "Fastest over all corpora on this CPU: " << kernels[best].first << endl;
+}
+
+// Compare the fused ingest pass with the separate copy, count and checksum
+// passes it replaces, then check the fused block encodes and verifies
+int benchIngest(int megabytes) {
+    size_t n = (size_t)megabytes << 20;
+    mt19937 rng(23);
+    string source = skewedText(n, rng);
+
+    typedef chrono::steady_clock clock;
+    const int rounds = 5;
+    IngestBuffer buffer(n);
+    string copy;
+    uint32_t counts[256];
+    uint32_t separateSum = 0, fusedSum = 0;
+
+    clock::time_point start = clock::now();
+    for (int r = 0; r < rounds; r++) {
+        copy = source;  // What sethuffmanString does
+        fill(counts, counts + 256, 0);
+        countHistogram(copy.data(), n, counts);  // What MakeTable does
+        separateSum = adler32(copy.data(), n);  // The integrity pass that was missing
+    }
+    double separate = chrono::duration<double>(clock::now() - start).count() / rounds;
+
+    start = clock::now();
+    for (int r = 0; r < rounds; r++) {
+        buffer.reset();
+        buffer.ingest(source);
+        buffer.histogram(counts);
+        fusedSum = buffer.checksum();
+    }
+    double fused = chrono::duration<double>(clock::now() - start).count() / rounds;
+
+    // Build codes from the ingested block, encode it from the buffer and verify
+    FrequencyTable table;
+    HuffmanTree tree;
+    vector<ByteSegment> block(1, buffer.segment());
+    table.LoadCounts(counts, block);
+    tree.buildTree(table);
+    unordered_map<char, string> codes = tree.generateCodes();
+    string bits;
+    tree.encode(block, codes, bits);
+    string decoded = tree.decode(bits);
+    bool verified = adler32(decoded.data(), decoded.length()) == fusedSum;
+
+    cout << fixed << setprecision(0);
+    cout << left << setw(34) << "Copy + count + checksum passes" << megabytes / separate << " MB/s" << endl;
+    cout << left << setw(34) << "Fused ingest" << megabytes / fused << " MB/s" << endl;
+    cout.unsetf(ios::fixed);
+    cout << "Checksums agree: " << (separateSum == fusedSum ? "yes" : "NO") << endl;
+    cout << "Decoded block verified against checksum: " << (verified ? "yes" : "NO") << endl;
+    return (separateSum == fusedSum && verified) ? 0 : 1;
+}
+
+// Compare the split JSON streams with one byte-level table on generated
+// records, and check round trips including text that is not JSON
+int benchJson(int records) {
+    mt19937 rng(37);
+    const char* levels[] = {"debug", "info", "warn", "error"};
+    const char* paths[] = {"/api/users", "/api/orders", "/login", "/static/app.js", "/health"};
+    const char* agents[] = {"Mozilla/5.0 (X11; Linux x86_64)", "curl/8.4.0", "okhttp/4.12"};
+    string json = "[\n";
+    for (int i = 0; i < records; i++) {
+        ostringstream record;
+        record << "  {\"ts\": " << 1700000000 + i * 7 + rng() % 5
+               << ", \"level\": \"" << levels[rng() % 4] << "\""
+               << ", \"request\": {\"method\": \"GET\", \"path\": \"" << paths[rng() % 5] << "\", \"status\": "
+               << (rng() % 10 ? 200 : 404) << "}"
+               << ", \"latency_ms\": " << (rng() % 5000) / 100.0
+               << ", \"agent\": \"" << agents[rng() % 3] << "\""
+               << ", \"tags\": [\"t" << rng() % 8 << "\", \"quote \\\"" << rng() % 100 << "\\\"\"]"
+               << ", \"cached\": " << (rng() % 2 ? "true" : "false") << ", \"user\": null}";
+        json += record.str() + (i + 1 < records ? ",\n" : "\n");
+    }
+    json += "]";
+
+    typedef chrono::steady_clock clock;
+    JsonCodec::Mode mode;
+    clock::time_point start = clock::now();
+    string bits = JsonCodec::encode(json, &mode);
+    double encodeSeconds = chrono::duration<double>(clock::now() - start).count();
+    string decoded;
+    start = clock::now();
+    bool ok = JsonCodec::decode(bits, decoded) && decoded == json && mode == JsonCodec::SPLIT;
+    double decodeSeconds = chrono::duration<double>(clock::now() - start).count();
+
+    // One table over all bytes, tree included, as the single-stream baseline
+    vector<ByteSegment> whole(1, ByteSegment{json.data(), json.length()});
+    FrequencyTable table;
+    HuffmanTree tree;
+    table.MakeTable(whole);
+    tree.buildTree(table);
+    unordered_map<char, string> codes = tree.generateCodes();
+    string single;
+    tree.serialize(single);
+    tree.encode(whole, codes, single);
+
+    const char* cases[] = {"", "{}", "{\"a\":{\"a\":[1,-2.5e+3,\"\\\\\"]}}", "[1, 2", "{\"a\" 1}}", "plain text, not json",
+                           "\"unterminated", "[\"\\u00e9\\n\", true, false, null]"};
+    for (const char* text : cases) {
+        string back;
+        ok = ok && JsonCodec::decode(JsonCodec::encode(text), back) && back == text;
+    }
+    string noise(4096, ' ');
+    for (char& c : noise) c = (char)(rng() % 256);
+    string back;
+    ok = ok && JsonCodec::decode(JsonCodec::encode(noise, &mode), back) && back == noise && mode == JsonCodec::SINGLE;
+
+    double megabytes = json.length() / 1048576.0;
+    cout << fixed << setprecision(3);
+    cout << "Input: " << json.length() << " bytes of JSON in " << records << " records" << endl;
+    cout << left << setw(26) << "Single byte-level table" << single.length() / 8 << " bytes ("
+         << single.length() / (double)json.length() << " bits/byte)" << endl;
+    cout << left << setw(26) << "Split JSON streams" << bits.length() / 8 << " bytes ("
+         << bits.length() / (double)json.length() << " bits/byte)" << endl;
+    cout << setprecision(0);
+    cout << "Encode " << megabytes / encodeSeconds << " MB/s, decode " << megabytes / decodeSeconds << " MB/s" << endl;
+    cout.unsetf(ios::fixed);
+    cout << "Round trips (including non-JSON fallback): " << (ok ? "ok" : "FAILED") << endl;
+    return ok ? 0 : 1;
+}
+
+// Compare zero-run coding with one byte-level table on data with a growing
+// share of zero bytes, and check which mode the histogram selects
+int benchSparse(int megabytes) {
+    mt19937 rng(67);
+    const double zeroFractions[] = {0.2, 0.4, 0.5, 0.6, 0.8, 0.95, 0.99};
+    size_t n = (size_t)megabytes << 20;
+    bool ok = true;
+    typedef chrono::steady_clock clock;
+
+    cout << left << setw(8) << "Zeros" << setw(14) << "Plain b/B" << setw(14) << "Zero-run b/B" << setw(11)
+         << "Selected" << setw(14) << "Encode MB/s" << "Decode MB/s" << endl;
+    cout << string(72, '-') << endl;
+    for (double fraction : zeroFractions) {
+        // Nonzero values are mostly small, as in sparse counters or deltas
+        string data(n, '\0');
+        for (char& c : data) {
+            if (uniform_real_distribution<double>(0.0, 1.0)(rng) >= fraction) {
+                c = (char)max<int>(1, min<int>(255, (int)geometric_distribution<int>(0.15)(rng)));
+            }
+        }
+
+        string plain = ZeroRunCodec::encode(data, ZeroRunCodec::PLAIN);
+        ZeroRunCodec::Mode mode;
+        clock::time_point start = clock::now();
+        string bits = ZeroRunCodec::encode(data, &mode);
+        double encodeSeconds = chrono::duration<double>(clock::now() - start).count();
+        string zeroRun = (mode == ZeroRunCodec::ZERO_RUN) ? bits : ZeroRunCodec::encode(data, ZeroRunCodec::ZERO_RUN);
+        string decoded;
+        start = clock::now();
+        ok = ZeroRunCodec::decode(bits, decoded) && decoded == data && ok;
+        double decodeSeconds = chrono::duration<double>(clock::now() - start).count();
+        ok = ZeroRunCodec::decode(zeroRun, decoded) && decoded == data && ok;
+
+        cout << fixed << setprecision(2) << left << setw(8) << fraction << setw(14) << plain.length() / (double)n
+             << setw(14) << zeroRun.length() / (double)n << setw(11)
+             << (mode == ZeroRunCodec::ZERO_RUN ? "zero-run" : "plain") << setprecision(0) << setw(14)
+             << megabytes / encodeSeconds << megabytes / decodeSeconds << endl;
+        cout.unsetf(ios::fixed);
+    }
+
+    const char* cases[] = {"", "a", "\x01", "plain text without zeros"};
+    for (const char* text : cases) {
+        string back;
+        ok = ZeroRunCodec::decode(ZeroRunCodec::encode(text, ZeroRunCodec::ZERO_RUN), back) && back == text && ok;
+    }
+    for (size_t zeros : {1, 15, 16, 17, 32, 100}) {
+        string edge = string(zeros, '\0') + "\xff" + string(zeros, '\0'), back;
+        ok = ZeroRunCodec::decode(ZeroRunCodec::encode(edge, ZeroRunCodec::ZERO_RUN), back) && back == edge && ok;
+        ok = ZeroRunCodec::decode(ZeroRunCodec::encode(string(zeros, '\0'), ZeroRunCodec::ZERO_RUN), back)
+            && back == string(zeros, '\0') && ok;
+    }
+    cout << string(72, '-') << endl;
+    return roundTripVerdict(ok);
+}
+
+// Compare template extraction with one byte-level table on generated logs
+// from a few hundred format strings
+int benchLogs(int lines, int threads) {
+    mt19937 rng(41);
+    const char* verbs[] = {"Accepted", "Rejected", "Opened", "Closed", "Retrying", "Finished", "Started", "Dropped"};
+    const char* objects[] = {"connection", "session", "request", "job", "file", "lease", "stream", "query"};
+    const char* modules[] = {"http", "db", "cache", "auth", "scheduler", "storage"};
+    vector<string> formats;
+    for (const char* verb : verbs) {
+        for (const char* object : objects) {
+            for (const char* module : modules) {
+                formats.push_back(string("INFO [") + module + "] " + verb + " " + object + " id=%d from %i in %d ms");
+                if (formats.size() % 3 == 0) formats.push_back(string("WARN [") + module + "] " + verb + " " + object + " %d after timeout user %u");
+            }
+        }
+    }
+
+    string text;
+    long long clockMs = 1700000000000LL;
+    const char* users[] = {"alice", "bob", "carol", "dave", "erin"};
+    for (int n = 0; n < lines; n++) {
+        clockMs += rng() % 50;
+        const string& format = formats[min(formats.size() - 1, (size_t)(formats.size() * pow((rng() % 1000) / 1000.0, 3)))];
+        text += to_string(clockMs) + " ";
+        for (size_t i = 0; i < format.length(); i++) {
+            if (format[i] != '%') {
+                text += format[i];
+                continue;
+            }
+            char kind = format[++i];
+            if (kind == 'd') text += to_string(rng() % 100000);
+            else if (kind == 'i') text += "10.0." + to_string(rng() % 4) + "." + to_string(rng() % 256);
+            else text += users[rng() % 5];
+        }
+        if (n + 1 < lines) text += '\n';
+    }
+
+    typedef chrono::steady_clock clock;
+    clock::time_point start = clock::now();
+    string bits = LogTemplateCodec::encode(text, threads);
+    double encodeSeconds = chrono::duration<double>(clock::now() - start).count();
+    string decoded;
+    start = clock::now();
+    bool ok = LogTemplateCodec::decode(bits, decoded, threads) && decoded == text;
+    double decodeSeconds = chrono::duration<double>(clock::now() - start).count();
+
+    // One table over all bytes as the baseline
+    vector<ByteSegment> whole(1, ByteSegment{text.data(), text.length()});
+    FrequencyTable table;
+    HuffmanTree tree;
+    table.MakeTable(whole);
+    tree.buildTree(table);
+    unordered_map<char, string> codes = tree.generateCodes();
+    string single;
+    tree.encode(whole, codes, single);
+    start = clock::now();
+    string plain = tree.decode(single);
+    double plainDecodeSeconds = chrono::duration<double>(clock::now() - start).count();
+
+    const char* cases[] = {"", "\n", "a  b\n\n c ", "x=1 y=2\nx=3 y=4\r\nx=5 y=6", "\x01 \x02\n\x01"};
+    for (const char* sample : cases) {
+        string back;
+        ok = ok && LogTemplateCodec::decode(LogTemplateCodec::encode(sample, threads), back, threads) && back == sample;
+    }
+
+    double megabytes = text.length() / 1048576.0;
+    cout << fixed << setprecision(2);
+    cout << "Input: " << text.length() << " bytes in " << lines << " lines from " << formats.size() << " formats" << endl;
+    cout << left << setw(26) << "Single byte-level table" << text.length() * 8.0 / single.length() << "x, decode "
+         << setprecision(0) << megabytes / plainDecodeSeconds << " MB/s" << endl;
+    cout << setprecision(2) << left << setw(26) << "Log templates" << text.length() * 8.0 / bits.length() << "x, decode "
+         << setprecision(0) << megabytes / decodeSeconds << " MB/s, encode " << megabytes / encodeSeconds << " MB/s" << endl;
+    cout.unsetf(ios::fixed);
+    return roundTripVerdict(ok);
+}
+
+// Model name of the CPU from /proc/cpuinfo, or "unknown"
+string cpuModel() {
+    ifstream cpuinfo("/proc/cpuinfo");
+    string line;
+    while (getline(cpuinfo, line)) {
+        if (line.compare(0, 10, "model name") != 0) continue;
+        size_t colon = line.find(':');
+        if (colon != string::npos) return line.substr(line.find_first_not_of(" \t", colon + 1));
+    }
+    return "unknown";
+}
+
+// File the profile is read from and written to: $HUFFMAN_TUNING or a file in
+// the working directory
+string tuningProfilePath() {
+    const char* path = getenv("HUFFMAN_TUNING");
+    return path ? path : "huffman-tuning.conf";
+}
+
+// Make a profile the one in effect, switching the histogram kernel.
+// Returns false if it names a kernel this CPU cannot run.
+bool applyTuningProfile(const TuningProfile& profile) {
+    for (const pair<string, HistogramKernel>& kernel : availableHistogramKernels()) {
+        if (kernel.first == profile.histogram) {
+            activeHistogramKernel() = kernel.second;
+            tuningProfile() = profile;
+            return true;
+        }
+    }
+    return false;
+}
+
+// Write a profile as key=value lines
+bool saveTuningProfile(const string& path, const TuningProfile& profile) {
+    ofstream file(path);
+    file << "cpu=" << profile.cpu << "\n";
+    file << "histogram=" << profile.histogram << "\n";
+    file << "decode_ways=" << profile.decodeWays << "\n";
+    file << "block_size=" << profile.blockSize << "\n";
+    return (bool)file;
+}
+
+// Read a profile and apply it if it was measured on this CPU model.
+// Returns false if the file is missing, malformed or for another CPU.
+bool loadTuningProfile(const string& path) {
+    ifstream file(path);
+    if (!file) return false;
+
+    TuningProfile profile = tuningProfile();
+    string line;
+    while (getline(file, line)) {
+        size_t equals = line.find('=');
+        if (equals == string::npos) continue;
+        string key = line.substr(0, equals), value = line.substr(equals + 1);
+        if (key == "cpu") profile.cpu = value;
+        else if (key == "histogram") profile.histogram = value;
+        else if (key == "decode_ways") profile.decodeWays = atoi(value.c_str());
+        else if (key == "block_size") profile.blockSize = strtoul(value.c_str(), nullptr, 10);
+    }
+    if (profile.cpu != cpuModel() || profile.decodeWays < 1 || profile.decodeWays > 4 || profile.blockSize == 0) {
+        return false;
+    }
+    return applyTuningProfile(profile);
+}
+
+// Best of a few runs of work, in seconds
+double bestTime(int runs, const function<void()>& work) {
+    double best = 1e30;
+    for (int r = 0; r < runs; r++) {
+        chrono::steady_clock::time_point start = chrono::steady_clock::now();
+        work();
+        best = min(best, chrono::duration<double>(chrono::steady_clock::now() - start).count());
+    }
+    return best;
+}
+
+// Measure every tunable choice on synthetic text and return the fastest.
+// Takes a few seconds; meant for install time or the first start.
+TuningProfile autotune(bool verbose) {
+    TuningProfile profile = tuningProfile();
+    profile.cpu = cpuModel();
+
+    mt19937 rng(43);
+    string text = skewedText(8 << 20, rng);
+
+    // Histogram kernel
+    double bestSeconds = 1e30;
+    for (const pair<string, HistogramKernel>& kernel : availableHistogramKernels()) {
+        uint32_t hist[256] = {0};
+        double seconds = bestTime(3, [&]() { kernel.second((const unsigned char*)text.data(), text.length(), hist); });
+        if (verbose) cout << "histogram " << left << setw(16) << kernel.first << (int)(8 / seconds) << " MB/s" << endl;
+        if (seconds < bestSeconds) {
+            bestSeconds = seconds;
+            profile.histogram = kernel.first;
+        }
+    }
+
+    // Interleave width of the decoder
+    vector<ByteSegment> whole(1, ByteSegment{text.data(), text.length()});
+    FrequencyTable table;
+    HuffmanTree tree;
+    table.MakeTable(whole);
+    tree.buildTree(table);
+    unordered_map<char, string> codes = tree.generateCodes();
+    vector<string> messages;
+    for (size_t i = 0; i < 256; i++) messages.push_back(tree.encode(text.substr(i * 4096, 4096), codes));
+    bestSeconds = 1e30;
+    for (int ways = 1; ways <= 4; ways++) {
+        double seconds = bestTime(3, [&]() { tree.decodeInterleaved(messages, ways); });
+        if (verbose) cout << "decode ways " << left << setw(14) << ways << (int)(1 / seconds) << " MB/s" << endl;
+        if (seconds < bestSeconds) {
+            bestSeconds = seconds;
+            profile.decodeWays = ways;
+        }
+    }
+
+    // Block size: the fastest of those whose output is within 2% of the smallest
+    const size_t sizes[] = {4096, 16384, 65535};
+    vector<double> seconds;
+    vector<size_t> bits;
+    string sample = text.substr(0, 2 << 20);
+    for (size_t size : sizes) {
+        size_t produced = 0;
+        seconds.push_back(bestTime(2, [&]() {
+            StreamingEncoder encoder(FlushPolicy{0, 0}, size);
+            encoder.write(sample);
+            encoder.flush();
+            produced = encoder.takeOutput().length();
+        }));
+        bits.push_back(produced);
+        if (verbose) {
+            cout << "block size " << left << setw(15) << size << (int)(2 / seconds.back()) << " MB/s, "
+                 << fixed << setprecision(3) << produced / (double)sample.length() << " bits/byte" << endl;
+            cout.unsetf(ios::fixed);
+        }
+    }
+    size_t smallest = *min_element(bits.begin(), bits.end());
+    bestSeconds = 1e30;
+    for (size_t i = 0; i < seconds.size(); i++) {
+        if (bits[i] <= smallest * 1.02 && seconds[i] < bestSeconds) {
+            bestSeconds = seconds[i];
+            profile.blockSize = sizes[i];
+        }
+    }
+    return profile;
+}
+
+// Compare decoding many messages one at a time with decode() against
+// decodeInterleaved() at every width, on messages coded with one shared table
+int benchInterleave(int messages, int size) {
+    mt19937 rng(83);
+    string text = skewedText((size_t)messages * size, rng);
+
+    vector<ByteSegment> whole(1, ByteSegment{text.data(), text.length()});
+    FrequencyTable table;
+    HuffmanTree tree;
+    table.MakeTable(whole);
+    tree.buildTree(table);
+    unordered_map<char, string> codes = tree.generateCodes();
+    vector<string> encoded(messages);
+    for (int i = 0; i < messages; i++) encoded[i] = tree.encode(text.substr((size_t)i * size, size), codes);
+
+    double megabytes = text.length() / 1e6;
+    bool ok = true;
+    vector<string> decoded(messages);
+    double single = megabytes / bestTime(3, [&]() {
+        for (int i = 0; i < messages; i++) decoded[i] = tree.decode(encoded[i]);
+    });
+    for (int i = 0; i < messages; i++) ok = ok && decoded[i] == text.substr((size_t)i * size, size);
+
+    cout << left << setw(32) << "decode() per message" << (int)single << " MB/s" << endl;
+    for (int ways = 1; ways <= 4; ways++) {
+        double rate = megabytes / bestTime(3, [&]() { decoded = tree.decodeInterleaved(encoded, ways); });
+        for (int i = 0; i < messages; i++) ok = ok && decoded[i] == text.substr((size_t)i * size, size);
+        cout << left << setw(32) << "decodeInterleaved, " + to_string(ways) + " way" + (ways > 1 ? "s" : "")
+             << (int)rate << " MB/s (" << fixed << setprecision(2) << rate / single << "x)" << endl;
+        cout.unsetf(ios::fixed);
+    }
+
+    // Undecodable bits give "" in both decoders
+    HuffmanTree partial;
+    FrequencyTable skewed;
+    skewed.sethuffmanString("aaaabbc");
+    skewed.MakeTable();
+    partial.buildTree(skewed);
+    vector<string> bad = {"0101", string(300, '1') + "0", "", "110"};
+    vector<string> interleaved = partial.decodeInterleaved(bad, 4);
+    for (size_t i = 0; i < bad.size(); i++) ok = ok && interleaved[i] == partial.decode(bad[i]);
+
+    return roundTripVerdict(ok);
+}
+
+// Multiplex many low-rate streams of four kinds and compare the frames with
+// coding every message on its own with the same codebooks
+int benchMux(int streams, int messages, int resident) {
+    mt19937 rng(47);
+    const string kinds[] = {"{\"id\":,\"ok\":true\"name\":\"\"}", "0123456789.-,:", "the quick brown fox jumps over a lazy dog ",
+                            "0123456789abcdef"};
+    function<string(int)> message = [&](int kind) {
+        string text;
+        size_t length = 20 + rng() % 60;
+        while (text.length() < length) {
+            const string& alphabet = kinds[kind];
+            double u = uniform_real_distribution<double>(0.0, 1.0)(rng);
+            text += alphabet[min((size_t)(alphabet.length() * u * u), alphabet.length() - 1)];
+        }
+        return text;
+    };
+
+    vector<string> corpus;
+    for (int i = 0; i < 2000; i++) corpus.push_back(message(i % 4));
+    CodebookSet codebooks;
+    codebooks.train(corpus, 4);
+
+    vector<pair<uint32_t, string>> writes;
+    unordered_map<uint32_t, string> expected;
+    for (int i = 0; i < messages; i++) {
+        uint32_t id = 1000 + rng() % streams;
+        writes.push_back(make_pair(id, message(id % 4)));
+        expected[id] += writes.back().second;
+    }
+
+    typedef chrono::steady_clock clock;
+    StreamMultiplexer mux(codebooks, resident);
+    clock::time_point start = clock::now();
+    for (const pair<uint32_t, string>& w : writes) mux.write(w.first, w.second);
+    mux.flush();
+    double seconds = chrono::duration<double>(clock::now() - start).count();
+    string frames = mux.takeOutput();
+
+    unordered_map<uint32_t, string> decoded;
+    bool ok = StreamMultiplexer::demultiplex(codebooks, frames, decoded) && decoded == expected;
+
+    // Every message as its own frame: the same tags plus the codebook byte, padded to a byte
+    size_t perMessage = 0, inputBytes = 0;
+    for (const pair<uint32_t, string>& w : writes) {
+        size_t bits = 48 + codebooks.encode(w.second).length();
+        perMessage += (bits + 7) / 8;
+        inputBytes += w.second.length();
+    }
+
+    cout << fixed << setprecision(2);
+    cout << "Streams: " << streams << ", messages: " << messages << ", input bytes: " << inputBytes << endl;
+    cout << left << setw(28) << "One frame per message" << perMessage << " bytes ("
+         << perMessage * 8.0 / inputBytes << " bits/byte)" << endl;
+    cout << left << setw(28) << "Multiplexed frames" << frames.length() / 8 << " bytes ("
+         << frames.length() / (double)inputBytes << " bits/byte), " << setprecision(0)
+         << inputBytes / 1048576.0 / seconds << " MB/s" << endl;
+    cout.unsetf(ios::fixed);
+    cout << "State per stream: " << StreamMultiplexer::stateBytes() << " bytes, resident: " << mux.getResident()
+         << ", evictions: " << mux.getEvictions() << endl;
+    cout << "Round trip: " << (ok ? "ok" : "FAILED") << endl;
+    return ok ? 0 : 1;
+}
+
+// Read a sparse set of random spots through a lazy mapping and compare with
+// decoding the whole archive first
+int benchLazyMap(int megabytes, int touches, int cacheBlocks, int readahead) {
+    mt19937 rng(53);
+    string text = skewedText((size_t)megabytes << 20, rng);
+    BlockArchive archive;
+    archive.build(text);
+
+    vector<size_t> spots(touches);
+    for (size_t& spot : spots) spot = rng() % (text.length() - 64);
+
+    typedef chrono::steady_clock clock;
+    bool ok = true;
+
+    // Full decode up front, then the reads
+    clock::time_point start = clock::now();
+    vector<char> all(archive.getSize());
+    for (size_t k = 0; k < archive.blockCount(); k++) {
+        ok = ok && archive.decodeBlock(k, all.data() + k * archive.getBlockSize());
+    }
+    unsigned long long sum = 0;
+    for (size_t spot : spots) {
+        for (int i = 0; i < 64; i++) sum += (unsigned char)all[spot + i];
+    }
+    double fullSeconds = chrono::duration<double>(clock::now() - start).count();
+
+    // Lazy mapping: only the touched blocks are decoded
+    start = clock::now();
+    LazyArchiveMapping mapping(archive, cacheBlocks, readahead);
+    unsigned long long lazySum = 0;
+    for (size_t spot : spots) {
+        for (int i = 0; i < 64; i++) lazySum += (unsigned char)mapping.data()[spot + i];
+    }
+    double lazySeconds = chrono::duration<double>(clock::now() - start).count();
+
+    for (size_t spot : spots) {
+        ok = ok && equal(text.begin() + spot, text.begin() + spot + 64, mapping.data() + spot);
+    }
+    ok = ok && sum == lazySum && !mapping.hasFailed();
+
+    cout << fixed << setprecision(3);
+    cout << "Archive: " << archive.getSize() << " bytes in " << archive.blockCount() << " blocks, "
+         << archive.getPackedSize() << " bytes packed" << endl;
+    cout << "Reads: " << touches << " random 64-byte spots" << endl;
+    cout << left << setw(24) << "Full decode first" << fullSeconds << " s, " << archive.blockCount() << " blocks decoded" << endl;
+    cout << left << setw(24) << (mapping.isLazy() ? "userfaultfd mapping" : "Fallback (decode all)") << lazySeconds
+         << " s, " << mapping.getBlocksDecoded() << " blocks decoded" << endl;
+    cout.unsetf(ios::fixed);
+    cout << "Contents match: " << (ok ? "yes" : "NO") << endl;
+    return ok ? 0 : 1;
+}
+
+// Diff a generated config file against an edited copy and time applying the patch
+int benchDelta(int megabytes, int edits) {
+    mt19937 rng(59);
+    string reference;
+    const char* keys[] = {"timeout", "retries", "endpoint", "weight", "enabled", "threshold", "path", "replicas"};
+    while (reference.length() < ((size_t)megabytes << 20)) {
+        reference += string("section.") + to_string(rng() % 5000) + "." + keys[rng() % 8] + " = " + to_string(rng() % 1000000) + "\n";
+    }
+
+    // Edit copy: replace, insert and delete short ranges at random spots
+    string target = reference;
+    for (int e = 0; e < edits; e++) {
+        size_t at = rng() % (target.length() - 100);
+        int kind = rng() % 3;
+        string text = to_string(rng());
+        if (kind == 0) target.replace(at, text.length(), text);
+        else if (kind == 1) target.insert(at, text);
+        else target.erase(at, 1 + rng() % 64);
+    }
+
+    typedef chrono::steady_clock clock;
+    clock::time_point start = clock::now();
+    string bits = DeltaCodec::diff(reference, target);
+    double diffSeconds = chrono::duration<double>(clock::now() - start).count();
+
+    start = clock::now();
+    DeltaPatch patch;
+    bool ok = DeltaCodec::parse(bits, reference.length(), patch);
+    double parseSeconds = chrono::duration<double>(clock::now() - start).count();
+
+    string rebuilt(patch.targetLength, '\0');
+    const int rounds = 10;
+    start = clock::now();
+    for (int r = 0; r < rounds && ok; r++) DeltaCodec::apply(patch, reference.data(), &rebuilt[0]);
+    double applySeconds = chrono::duration<double>(clock::now() - start).count() / rounds;
+    ok = ok && rebuilt == target;
+
+    size_t streamed = 0;
+    uint32_t checksum = 1;
+    DeltaCodec::apply(patch, reference.data(), [&](const char* data, size_t n) {
+        checksum = adler32(data, n, checksum);
+        streamed += n;
+    });
+    ok = ok && streamed == target.length() && checksum == adler32(target.data(), target.length());
+
+    const char* cases[][2] = {{"", ""}, {"", "abc"}, {"abc", ""}, {"0123456789abcdefXYZ", "0123456789abcdef"},
+                              {"0123456789abcdef0123456789abcdef", "xx0123456789abcdef0123456789abcdefyy"}};
+    for (const auto& c : cases) {
+        string back;
+        ok = ok && DeltaCodec::patch(c[0], DeltaCodec::diff(c[0], c[1]), back) && back == c[1];
+    }
+    string back;
+    ok = ok && !DeltaCodec::patch(string(10, 'a'), bits, back);  // Copies past the end of this reference
+
+    cout << fixed << setprecision(3);
+    cout << "Reference: " << reference.length() << " bytes, target: " << target.length() << " bytes, " << edits << " edits" << endl;
+    cout << "Patch: " << bits.length() / 8 << " bytes, " << patch.instructions.size() << " instructions, "
+         << patch.literals.length() << " literal bytes" << endl;
+    cout << "Diff " << diffSeconds << " s, decode patch " << parseSeconds * 1000 << " ms, apply "
+         << setprecision(2) << target.length() / applySeconds / 1e9 << " GB/s" << endl;
+    cout.unsetf(ios::fixed);
+    return roundTripVerdict(ok);
+}
+
+// Feed arbitrary bytes to the decoders that take untrusted input. The first
+// byte gives how many of the following bytes describe a serialized tree; the
+// rest is the encoded input. Aborts if the hardened decoder disagrees with
+// the bit-at-a-time decoder on input both accept. The drivers below set
+// streamByteLimit() to FUZZ_STREAM_BYTES once before the first input.
+const size_t FUZZ_STREAM_BYTES = 1 << 20;  // Far more than any input here can describe honestly
+int fuzzDecoders(const uint8_t* data, size_t size) {
+    if (size == 0) return 0;
+    size_t treeBytes = min<size_t>(data[0], size - 1);
+    string treeBits = unpackBits((const char*)data + 1, treeBytes);
+    string input((const char*)data + 1 + treeBytes, size - 1 - treeBytes);
+    string bits = unpackBits(input.data(), input.length());
+
+    HuffmanTree tree;
+    size_t pos = 0;
+    tree.deserialize(treeBits, pos);
+
+    string padded = input + string(HuffmanTree::INPUT_PADDING, '\0');
+    string hardened, walked;
+    bool accepted = tree.decodePacked((const uint8_t*)padded.data(), bits.length(), hardened);
+    pos = 0;
+    tree.decodeCount(bits, pos, bits.length(), walked);
+    if (accepted && walked.compare(0, hardened.length(), hardened) != 0) abort();
+    string whole = tree.decode(bits);
+    vector<string> lanes = {bits, bits.substr(0, bits.length() / 2), bits, bits.substr(bits.length() / 3)};
+    vector<string> interleaved = tree.decodeInterleaved(lanes, 4);
+    for (size_t l = 0; l < lanes.size(); l++) {
+        if (interleaved[l] != (l % 2 == 0 ? whole : tree.decode(lanes[l]))) abort();
+    }
+
+    pos = 0;
+    string stream;
+    readHuffmanStream(bits, pos, stream);
+    JsonCodec::decode(bits, stream);
+    ZeroRunCodec::decode(bits, stream);
+    DeltaPatch patch;
+    DeltaCodec::parse(bits, 1 << 20, patch);
+    StreamingDecoder streaming;
+    streaming.feed(bits);
+    char tiny[TinyCodec::MAX_INPUT];
+    TinyCodec::decode((const uint8_t*)input.data(), input.length(), tiny);
+
+    BlockArchive archive;
+    istringstream archiveBytes(input);
+    if (archive.load(archiveBytes)) {
+        vector<char> block(archive.getBlockSize());
+        for (size_t k = 0; k < archive.blockCount(); k++) archive.decodeBlock(k, block.data());
+    }
+    return 0;
+}
+
+#ifdef HUFFMAN_FUZZ
+// libFuzzer entry points: build with -DHUFFMAN_FUZZ -fsanitize=fuzzer,address
+extern "C" int LLVMFuzzerInitialize(int*, char***) {
+    streamByteLimit() = FUZZ_STREAM_BYTES;
+    return 0;
+}
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t* data, size_t size) { return fuzzDecoders(data, size); }
+#endif
+
+// Run fuzzDecoders on mutated encodings of random text, for builds without libFuzzer
+int fuzzDecoderTool(int iterations) {
+    streamByteLimit() = FUZZ_STREAM_BYTES;
+    mt19937 rng(61);
+    for (int i = 0; i < iterations; i++) {
+        string text(1 + rng() % 200, ' ');
+        for (char& c : text) c = (char)(rng() % (2 + rng() % 255));
+
+        vector<ByteSegment> segments(1, ByteSegment{text.data(), text.length()});
+        FrequencyTable table;
+        HuffmanTree tree;
+        table.MakeTable(segments);
+        tree.buildTree(table);
+        unordered_map<char, string> codes = tree.generateCodes();
+        string treeBits;
+        tree.serialize(treeBits);
+        string tree8 = packBits(treeBits);
+        string bits;
+        tree.encode(segments, codes, bits);
+        string body = packBits(bits);
+        // Every fourth input is a zero-run encoding and every fourth a block
+        // archive, so their parsers are reached
+        if (i % 4 == 3) body = packBits(ZeroRunCodec::encode(text, ZeroRunCodec::ZERO_RUN));
+        if (i % 4 == 1) {
+            BlockArchive archive;
+            archive.build(text, 1 + rng() % 64);
+            ostringstream saved;
+            archive.save(saved);
+            body = saved.str();
+        }
+
+        string input(1, (char)min<size_t>(tree8.length(), 255));
+        input += tree8 + body;
+        int flips = rng() % 4;
+        for (int f = 0; f < flips; f++) input[rng() % input.length()] ^= (char)(1 << (rng() % 8));
+        if (rng() % 8 == 0) input.resize(rng() % (input.length() + 1));
+        fuzzDecoders((const uint8_t*)input.data(), input.length());
+    }
+    cout << iterations << " inputs decoded without a fault" << endl;
+    return 0;
+}
+
+// Compare the hardened packed decoder with the bit-at-a-time decoders
+int benchHardened(int megabytes) {
+    mt19937 rng(67);
+    string text = skewedText((size_t)megabytes << 20, rng);
+    vector<ByteSegment> whole(1, ByteSegment{text.data(), text.length()});
+    FrequencyTable table;
+    HuffmanTree tree;
+    table.MakeTable(whole);
+    tree.buildTree(table);
+    unordered_map<char, string> codes = tree.generateCodes();
+    string bits;
+    tree.encode(whole, codes, bits);
+    string packed = packBits(bits) + string(HuffmanTree::INPUT_PADDING, '\0');
+
+    typedef chrono::steady_clock clock;
+    string walked, hardened, unchecked, viaString;
+    size_t pos = 0;
+    clock::time_point start = clock::now();
+    tree.decodeCount(bits, pos, text.length(), walked);
+    double walkSeconds = chrono::duration<double>(clock::now() - start).count();
+
+    start = clock::now();
+    bool ok = tree.decodePacked((const uint8_t*)packed.data(), bits.length(), hardened);
+    double hardenedSeconds = chrono::duration<double>(clock::now() - start).count();
+
+    start = clock::now();
+    tree.decodePackedUnchecked((const uint8_t*)packed.data(), text.length(), unchecked);
+    double uncheckedSeconds = chrono::duration<double>(clock::now() - start).count();
+
+    start = clock::now();
+    viaString = tree.decode(bits);
+    double stringSeconds = chrono::duration<double>(clock::now() - start).count();
+    ok = ok && walked == text && hardened == text && unchecked == text && viaString == text;
+
+    cout << fixed << setprecision(0);
+    cout << left << setw(40) << "Decode table, bit at a time (checked)" << megabytes / walkSeconds << " MB/s" << endl;
+    cout << left << setw(40) << "Packed decoder, unchecked" << megabytes / uncheckedSeconds << " MB/s" << endl;
+    cout << left << setw(40) << "Hardened packed decoder" << megabytes / hardenedSeconds << " MB/s" << endl;
+    cout << left << setw(40) << "decode(string): pack + hardened" << megabytes / stringSeconds << " MB/s" << endl;
+    cout.unsetf(ios::fixed);
+    return roundTripVerdict(ok);
+}
+
+// Fill a raw and a compressed cache with the same budget and compare how many
+// values each holds and what a hit costs
+int benchCache(int budgetMB, int lookups) {
+    mt19937 rng(71);
+    const char* fields[] = {"\"user\":\"", "\"status\":\"active\"", "\"plan\":\"", "\"region\":\"eu-west-1\"", "\"tags\":[\"a\",\"b\"]"};
+    function<string(int)> value = [&](int i) {
+        string text = "{\"id\":" + to_string(i);
+        int count = 3 + rng() % 12;
+        for (int f = 0; f < count; f++) {
+            text += ",";
+            text += fields[rng() % 5];
+            if (text.back() == '"') text += "name" + to_string(rng() % 1000) + "\"";
+        }
+        return text + "}";
+    };
+
+    vector<string> corpus;
+    for (int i = 0; i < 2000; i++) corpus.push_back(value(i));
+    CodebookSet codebooks;
+    codebooks.train(corpus, 4);
+
+    size_t budget = (size_t)budgetMB << 20;
+    CompressedCache raw(nullptr, budget), compressed(&codebooks, budget);
+    int keys = 0;
+    while (raw.getEvictions() == 0 || compressed.getEvictions() == 0) {
+        string key = "key:" + to_string(keys);
+        string v = value(keys++);
+        raw.put(key, v);
+        compressed.put(key, v);
+    }
+
+    // Look up the most recent keys, which both caches still hold
+    typedef chrono::steady_clock clock;
+    size_t recent = min<size_t>(raw.getEntries(), compressed.getEntries()) / 2;
+    vector<string> probe;
+    for (int i = 0; i < lookups; i++) probe.push_back("key:" + to_string(keys - 1 - rng() % recent));
+    double seconds[2];
+    bool ok = true;
+    CompressedCache* caches[2] = {&raw, &compressed};
+    for (int c = 0; c < 2; c++) {
+        string out;
+        clock::time_point start = clock::now();
+        for (const string& key : probe) ok = caches[c]->get(key, out) && ok;
+        seconds[c] = chrono::duration<double>(clock::now() - start).count();
+    }
+    for (int i = 0; i < 100 && ok; i++) {
+        string a, b;
+        ok = raw.get(probe[i], a) && compressed.get(probe[i], b) && a == b;
+    }
+
+    // A value too large to cache must still replace the older value of its key
+    string oversized(budget / CompressedCache::SHARDS + 1, '\0'), out;
+    for (char& c : oversized) c = (char)rng();
+    bool dropped = true;
+    for (CompressedCache* cache : caches) {
+        cache->put(probe[0], oversized);
+        dropped = !cache->get(probe[0], out) && dropped;
+    }
+
+    cout << fixed << setprecision(2);
+    cout << "Budget: " << budgetMB << " MB per cache" << endl;
+    cout << left << setw(14) << "Raw" << setw(10) << raw.getEntries() << " entries, " << setprecision(0)
+         << seconds[0] / lookups * 1e9 << " ns per hit" << endl;
+    cout << left << setw(14) << "Compressed" << setw(10) << compressed.getEntries() << " entries, "
+         << seconds[1] / lookups * 1e9 << " ns per hit" << endl;
+    cout << setprecision(2) << "Capacity gain: " << compressed.getEntries() / (double)raw.getEntries()
+         << "x, added hit latency: " << setprecision(0) << (seconds[1] - seconds[0]) / lookups * 1e9 << " ns" << endl;
+    cout.unsetf(ios::fixed);
+    cout << "Hits agree: " << (ok ? "yes" : "NO") << endl;
+    cout << "Oversized overwrite misses: " << (dropped ? "yes" : "NO") << endl;
+    return ok && dropped ? 0 : 1;
+}
+
+// MemorySample is the process memory the soak tool sees at one moment
+struct MemorySample {
+    size_t rssBytes;  // Resident set size, 0 where /proc is unavailable
+    size_t heapInUse;  // Bytes handed out by malloc
+    size_t heapFree;  // Bytes malloc holds but has not handed out
+};
+
+// Read the resident set size and the allocator statistics of this process
+MemorySample sampleMemory() {
+    MemorySample sample = {0, 0, 0};
+#ifdef __linux__
+    ifstream statm("/proc/self/statm");
+    size_t pages = 0, resident = 0;
+    if (statm >> pages >> resident) sample.rssBytes = resident * (size_t)sysconf(_SC_PAGESIZE);
+#endif
+#ifdef HUFFMAN_MALLINFO2
+    struct mallinfo2 info = mallinfo2();
+    sample.heapInUse = info.uordblks + info.hblkhd;
+    sample.heapFree = info.fordblks;
+#endif
+    return sample;
+}
+
+// Change of a least-squares line through values[from..] over that span,
+// relative to their mean
+double trendGrowth(const vector<double>& values, size_t from) {
+    size_t n = values.size() - from;
+    if (n < 2) return 0;
+    double meanX = (n - 1) / 2.0, meanY = 0;
+    for (size_t i = from; i < values.size(); i++) meanY += values[i] / n;
+    double covariance = 0, variance = 0;
+    for (size_t i = from; i < values.size(); i++) {
+        covariance += (i - from - meanX) * (values[i] - meanY);
+        variance += (i - from - meanX) * (i - from - meanX);
+    }
+    return meanY > 0 ? covariance / variance * (n - 1) / meanY : 0;
+}
+
+// Run encode/decode cycles over varied inputs through the reused objects of
+// the menu loop and through the per-call codecs, the cache and the registry,
+// sampling RSS, heap use and speed as it goes. The first quarter of the run is
+// warm-up. After it, the run fails if the fitted trend grows RSS or heap use
+// by more than 10% (and 1 MB), the share of the heap malloc holds free (a
+// sign of fragmentation) by more than 25% (and 15 points), or the time per
+// cycle by more than 25%.
+int soak(long long cycles, int samples) {
+    mt19937 rng(79);
+    function<string()> input = [&]() {
+        size_t n = 1 + min<size_t>(4095, (size_t)exponential_distribution<double>(1.0 / 256)(rng));
+        string text(n, '\0');
+        switch (rng() % 3) {
+        case 0:  // Skewed text
+            text = skewedText(n, rng);
+            break;
+        case 1:  // Sparse binary
+            for (char& c : text) c = (rng() % 8 == 0) ? (char)(1 + rng() % 255) : '\0';
+            break;
+        default:  // JSON records
+            text = "[";
+            for (size_t i = 0; text.length() < n; i++) {
+                text += (i ? ",{\"id\":" : "{\"id\":") + to_string(rng() % 100000) + ",\"name\":\"user" + to_string(rng() % 500) + "\"}";
+            }
+            text += "]";
+        }
+        if (text.find_first_not_of(text[0]) == string::npos) text += '!';  // One-character strings cannot use the menu path
+        return text;
+    };
+
+    vector<string> corpus;
+    for (int i = 0; i < 500; i++) corpus.push_back(input());
+    CodebookSet codebooks;
+    codebooks.train(corpus, 4);
+    CompressedCache cache(&codebooks, 2 << 20);
+    for (int k = 0; k < 20000; k++) cache.put("key:" + to_string(k), corpus[k % corpus.size()]);  // Start full and evicting
+    CodebookRegistry registry;
+    int published = registry.publish(corpus);
+
+    FrequencyTable table;  // Reused like the menu loop reuses them
+    HuffmanTree tree;
+    long long perSample = max<long long>(1, cycles / samples), failures = 0;
+    vector<double> rss, heap, freeShare, cycleMicros;
+    typedef chrono::steady_clock clock;
+
+    cout << left << setw(12) << "Cycles" << setw(11) << "Cycles/s" << setw(8) << "MB/s" << setw(10) << "RSS MB"
+         << setw(10) << "Heap MB" << setw(10) << "Free MB" << "Free %" << endl;
+    cout << string(67, '-') << endl;
+    for (int sample = 1; sample <= samples; sample++) {
+        size_t bytes = 0;
+        clock::time_point start = clock::now();
+        for (long long i = 0; i < perSample; i++) {
+            string text = input(), decoded;
+            bytes += text.length();
+
+            table.Clear();
+            table.sethuffmanString(text);
+            table.MakeTable();
+            tree.buildTree(table);
+            unordered_map<char, string> codes = tree.generateCodes();
+            failures += tree.decode(tree.encode(text, codes)) != text;
+
+            failures += !ZeroRunCodec::decode(ZeroRunCodec::encode(text), decoded) || decoded != text;
+            failures += !JsonCodec::decode(JsonCodec::encode(text), decoded) || decoded != text;
+            if (text.length() <= TinyCodec::MAX_INPUT) {
+                uint8_t packed[TinyCodec::MAX_OUTPUT];
+                char back[TinyCodec::MAX_INPUT];
+                size_t size = TinyCodec::encode(text.data(), text.length(), packed);
+                failures += TinyCodec::decode(packed, size, back) != (int)text.length();
+            }
+
+            string key = "key:" + to_string(rng() % 20000);
+            cache.put(key, text);
+            failures += cache.get(key, decoded) && decoded != text;
+            failures += registry.decode(registry.encode(text)) != text;
+            if (rng() % 1000 == 0) {  // Hot-swap the codebook, retiring the old one
+                int next = registry.publish(corpus);
+                registry.retire(published);
+                published = next;
+            }
+        }
+        double seconds = chrono::duration<double>(clock::now() - start).count();
+
+        MemorySample memory = sampleMemory();
+        rss.push_back(memory.rssBytes);
+        heap.push_back(memory.heapInUse);
+        size_t heapHeld = memory.heapInUse + memory.heapFree;
+        freeShare.push_back(heapHeld > 0 ? (double)memory.heapFree / heapHeld : 0);
+        cycleMicros.push_back(seconds * 1e6 / perSample);
+        cout << left << fixed << setprecision(0) << setw(12) << perSample * sample << setw(11) << perSample / seconds
+             << setprecision(1) << setw(8) << bytes / 1e6 / seconds << setw(10) << memory.rssBytes / 1048576.0
+             << setw(10) << memory.heapInUse / 1048576.0 << setw(10) << memory.heapFree / 1048576.0
+             << freeShare.back() * 100 << endl;
+        cout.unsetf(ios::fixed);
+    }
+    cout << string(67, '-') << endl;
+
+    size_t warm = samples / 4;
+    double rssGrowth = trendGrowth(rss, warm), heapGrowth = trendGrowth(heap, warm), timeGrowth = trendGrowth(cycleMicros, warm);
+    double freeGrowth = trendGrowth(freeShare, warm);
+    double mb = 1048576.0;
+    bool rssLeak = rssGrowth > 0.10 && rssGrowth * rss.back() > mb;
+    bool heapLeak = heapGrowth > 0.10 && heapGrowth * heap.back() > mb;
+    bool fragmenting = freeGrowth > 0.25 && freeGrowth * freeShare.back() > 0.15;
+    bool slower = timeGrowth > 0.25;
+    cout << fixed << setprecision(1) << "Trend after warm-up: RSS " << rssGrowth * 100 << "%, heap " << heapGrowth * 100
+         << "%, free share of heap " << freeGrowth * 100 << "%, time per cycle " << timeGrowth * 100 << "%" << endl;
+    cout.unsetf(ios::fixed);
+    if (failures > 0) cout << "Error! " << failures << " round trips failed." << endl;
+    if (rssLeak || heapLeak) cout << "Error! Memory grows during the run." << endl;
+    if (fragmenting) cout << "Error! The heap fragments during the run." << endl;
+    if (slower) cout << "Error! Cycles get slower during the run." << endl;
+    bool ok = failures == 0 && !rssLeak && !heapLeak && !fragmenting && !slower;
+    cout << "Soak: " << (ok ? "ok" : "FAILED") << endl;
+    return ok ? 0 : 1;
+}
+
+// Read a corpus file with one message per line, or the payloads of a capture file
+vector<string> loadLines(const string& path) {
+    vector<string> lines;
+    vector<pair<string, string>> payloads;
+    if (WorkloadCapture::load(path, payloads)) {
+        for (const pair<string, string>& payload : payloads) lines.push_back(payload.second);
+        return lines;
+    }
+    ifstream in(path, ios::binary);
+    string line;
+    while (getline(in, line)) {
+        if (!line.empty()) lines.push_back(line);
+    }
+    return lines;
+}
+
+// Train K codebooks on a corpus, report the gain over a single codebook and
+// optionally save them for CodebookSet::load()
+int trainCodebooks(const string& corpusPath, int k, const string& outputPath) {
+    vector<string> corpus = loadLines(corpusPath);
+    if (corpus.empty()) {
+        cout << "Error! Corpus " << corpusPath << " is empty or unreadable." << endl;
+        return 1;
+    }
+
+    CodebookSet single, clustered;
+    single.train(corpus, 1);
+    clustered.train(corpus, k);
+
+    size_t originalBits = 0, singleBits = 0, clusteredBits = 0;
+    vector<int> members(clustered.size(), 0);
+    for (const string& message : corpus) {
+        string encoded = clustered.encode(message);
+        if (clustered.decode(encoded) != message) {
+            cout << "Error: round trip failed." << endl;
+            return 1;
+        }
+        members[clustered.select(message)]++;
+        originalBits += message.length() * 8;
+        singleBits += single.encode(message).length();
+        clusteredBits += encoded.length();
+    }
+
+    cout << left << setw(15) << "Codebook" << setw(15) << "Messages" << endl;
+    cout << string(30, '-') << endl;
+    for (int j = 0; j < clustered.size(); j++) {
+        cout << left << setw(15) << j << setw(15) << members[j] << endl;
+    }
+    cout << string(30, '-') << endl;
+    cout << "Single codebook ratio: " << (float)singleBits / originalBits * 100 << "%\n";
+    cout << clustered.size() << " codebooks ratio: " << (float)clusteredBits / originalBits * 100 << "%\n";
+
+    if (!outputPath.empty()) {
+        if (!clustered.save(outputPath)) {
+            cout << "Error! Could not write " << outputPath << endl;
+            return 1;
+        }
+        cout << "Codebooks saved to " << outputPath << endl;
+    }
+    return 0;
+}
+
+// ParetoPoint is one configuration measured by exploreConfigurations
+struct ParetoPoint {
+    string mode;  // Coder or transform
+    string parameters;  // Settings of the mode as name=value pairs separated by ';'
+    double encodeMBps;  // Input megabytes encoded per second
+    double decodeMBps;  // Input megabytes decoded per second
+    double ratio;  // Input bytes over output bytes
+    bool roundTrip;  // The output decoded back to the input
+    bool pareto;  // No other point is as good on all three measures and better on one
+};
+
+// Time encoding and decoding of one configuration and add it to points.
+// encode returns the output size in bits, decode returns false on a mismatch.
+void measureConfiguration(vector<ParetoPoint>& points, const string& mode, const string& parameters, size_t inputBytes,
+                          int runs, const function<size_t()>& encode, const function<bool()>& decode) {
+    ParetoPoint point{mode, parameters, 0, 0, 0, true, false};
+    size_t bits = 0;
+    double megabytes = inputBytes / 1e6;
+    point.encodeMBps = megabytes / bestTime(runs, [&]() { bits = encode(); });
+    point.decodeMBps = megabytes / bestTime(runs, [&]() { point.roundTrip = decode() && point.roundTrip; });
+    point.ratio = inputBytes / max(bits / 8.0, 1.0);
+    points.push_back(point);
+}
+
+// Run every coder, transform and setting of the engine over a corpus. Modes that
+// code messages use the non-empty lines of the corpus; codebooks are trained
+// once outside the timing.
+vector<ParetoPoint> exploreConfigurations(const string& text, const vector<string>& lines, int runs) {
+    vector<ParetoPoint> points;
+    size_t lineBytes = 0;
+    for (const string& line : lines) lineBytes += line.length();
+
+    // Independent blocks, each with its own tree, for every histogram kernel
+    HistogramKernel savedKernel = activeHistogramKernel();
+    for (const pair<string, HistogramKernel>& kernel : availableHistogramKernels()) {
+        activeHistogramKernel() = kernel.second;
+        for (size_t blockSize = 4096; blockSize <= ((size_t)1 << 20); blockSize *= 4) {
+            BlockArchive archive;
+            string decoded(text.length(), '\0');
+            measureConfiguration(points, "block", "block_size=" + to_string(blockSize) + ";histogram=" + kernel.first,
+                text.length(), runs,
+                [&]() { archive.build(text, blockSize); return archive.getPackedSize() * 8; },
+                [&]() {
+                    for (size_t k = 0; k < archive.blockCount(); k++) {
+                        if (!archive.decodeBlock(k, &decoded[k * blockSize])) return false;
+                    }
+                    return decoded == text;
+                });
+        }
+    }
+    activeHistogramKernel() = savedKernel;
+
+    // Streaming frames that reuse the previous tree when it still fits
+    for (size_t blockSize : {(size_t)4096, (size_t)16384, StreamingEncoder::MAX_BLOCK}) {
+        string frames;
+        measureConfiguration(points, "stream", "block_size=" + to_string(blockSize), text.length(), runs,
+            [&]() {
+                StreamingEncoder encoder(FlushPolicy{0, 0}, blockSize);
+                encoder.write(text);
+                encoder.flush();
+                frames = encoder.takeOutput();
+                return frames.length();
+            },
+            [&]() { StreamingDecoder decoder; return decoder.feed(frames) == text; });
+    }
+
+    if (lines.empty()) return points;
+
+    // One table for every message, decoded one message at a time from bit
+    // strings or from packed bytes, or several messages at a time
+    FrequencyTable table;
+    vector<ByteSegment> segments;
+    for (const string& line : lines) segments.push_back(ByteSegment{line.data(), line.length()});
+    table.MakeTable(segments);
+    CodeTable shared(0, table);
+    HuffmanTree& sharedTree = shared.getTree();
+    vector<string> messages(lines.size()), packed(lines.size());
+    function<size_t()> encodeShared = [&]() {
+        size_t bits = 0;
+        for (size_t i = 0; i < lines.size(); i++) {
+            messages[i] = shared.encode(lines[i]);
+            bits += messages[i].length();
+        }
+        return bits;
+    };
+    measureConfiguration(points, "table", "decoder=decode", lineBytes, runs, encodeShared, [&]() {
+        for (size_t i = 0; i < lines.size(); i++) {
+            if (sharedTree.decode(messages[i]) != lines[i]) return false;
+        }
+        return true;
+    });
+    // Messages stored packed, as a cache or archive keeps them
+    measureConfiguration(points, "table", "decoder=packed", lineBytes, runs,
+        [&]() {
+            size_t bits = encodeShared();
+            for (size_t i = 0; i < lines.size(); i++) {
+                packed[i] = packBits(messages[i]);
+                packed[i].append(HuffmanTree::INPUT_PADDING, '\0');
+            }
+            return bits;
+        },
+        [&]() {
+            string decoded;
+            for (size_t i = 0; i < lines.size(); i++) {
+                if (!sharedTree.decodePacked((const uint8_t*)packed[i].data(), messages[i].length(), decoded)
+                    || decoded != lines[i]) return false;
+            }
+            return true;
+        });
+    for (int ways = 2; ways <= 4; ways++) {
+        measureConfiguration(points, "table", "decoder=interleaved;decode_ways=" + to_string(ways), lineBytes, runs,
+            encodeShared, [&]() { return sharedTree.decodeInterleaved(messages, ways) == lines; });
+    }
+
+    // K clustered codebooks, the cheapest chosen per message
+    for (int k = 1; k <= 8; k *= 2) {
+        CodebookSet codebooks;
+        codebooks.train(lines, k);
+        measureConfiguration(points, "codebooks", "k=" + to_string(k), lineBytes, runs,
+            [&]() {
+                size_t bits = 0;
+                for (size_t i = 0; i < lines.size(); i++) {
+                    messages[i] = codebooks.encode(lines[i]);
+                    bits += messages[i].length();
+                }
+                return bits;
+            },
+            [&]() {
+                for (size_t i = 0; i < lines.size(); i++) {
+                    if (codebooks.decode(messages[i]) != lines[i]) return false;
+                }
+                return true;
+            });
+    }
+
+    // Structure-aware transforms over the whole text
+    string bits, decoded;
+    JsonCodec::Mode jsonMode = JsonCodec::SINGLE;
+    measureConfiguration(points, "json", "", text.length(), runs,
+        [&]() { bits = JsonCodec::encode(text, &jsonMode); return bits.length(); },
+        [&]() { return JsonCodec::decode(bits, decoded) && decoded == text; });
+    points.back().parameters = (jsonMode == JsonCodec::SPLIT) ? "streams=split" : "streams=single";
+
+    ZeroRunCodec::Mode zeroMode = ZeroRunCodec::PLAIN;
+    measureConfiguration(points, "zero-run", "", text.length(), runs,
+        [&]() { bits = ZeroRunCodec::encode(text, &zeroMode); return bits.length(); },
+        [&]() { return ZeroRunCodec::decode(bits, decoded) && decoded == text; });
+    points.back().parameters = (zeroMode == ZeroRunCodec::ZERO_RUN) ? "symbols=zero-run" : "symbols=plain";
+
+    vector<int> threadCounts(1, 1);
+    if (thread::hardware_concurrency() > 1) threadCounts.push_back(thread::hardware_concurrency());
+    for (int threads : threadCounts) {
+        measureConfiguration(points, "logs", "threads=" + to_string(threads), text.length(), runs,
+            [&]() { bits = LogTemplateCodec::encode(text, threads); return bits.length(); },
+            [&]() { return LogTemplateCodec::decode(bits, decoded, threads) && decoded == text; });
+    }
+    return points;
+}
+
+// Flag the points no other point dominates on encode speed, decode speed and ratio.
+// Configurations that failed their round trip are never on the frontier.
+void markParetoFrontier(vector<ParetoPoint>& points) {
+    for (ParetoPoint& point : points) {
+        point.pareto = point.roundTrip;
+        for (const ParetoPoint& other : points) {
+            if (!point.pareto) break;
+            if (!other.roundTrip) continue;
+            bool noWorse = other.encodeMBps >= point.encodeMBps && other.decodeMBps >= point.decodeMBps
+                && other.ratio >= point.ratio;
+            bool better = other.encodeMBps > point.encodeMBps || other.decodeMBps > point.decodeMBps
+                || other.ratio > point.ratio;
+            if (noWorse && better) point.pareto = false;
+        }
+    }
+}
+
+// Index of the frontier point that is best for the objective ("decode" or
+// "encode" speed, or "ratio") among those with at least minRatio; -1 if none
+int recommendConfiguration(const vector<ParetoPoint>& points, const string& objective, double minRatio) {
+    auto score = [&](const ParetoPoint& point) {
+        return (objective == "encode") ? point.encodeMBps : (objective == "ratio") ? point.ratio : point.decodeMBps;
+    };
+    int best = -1;
+    for (size_t i = 0; i < points.size(); i++) {
+        if (!points[i].pareto || points[i].ratio < minRatio) continue;
+        if (best < 0 || score(points[i]) > score(points[best])) best = (int)i;
+    }
+    return best;
+}
+
+// Write every point as CSV with a header row
+bool writeParetoCsv(const string& path, const vector<ParetoPoint>& points) {
+    ofstream out(path);
+    out << "mode,parameters,encode_mb_s,decode_mb_s,ratio,round_trip,pareto\n";
+    for (const ParetoPoint& point : points) {
+        out << point.mode << ',' << point.parameters << ',' << fixed << setprecision(2) << point.encodeMBps << ','
+            << point.decodeMBps << ',' << setprecision(4) << point.ratio << ',' << point.roundTrip << ','
+            << point.pareto << '\n';
+    }
+    return (bool)out;
+}
+
+// Measure every configuration on a corpus, write them to a CSV file and print
+// the Pareto frontier with the configuration recommended for the objective.
+// For a capture file the payloads are the messages, and joined they are the text.
+int exploreTool(const string& corpusPath, const string& csvPath, const string& objective, double minRatio) {
+    ifstream in(corpusPath, ios::binary);
+    string text((istreambuf_iterator<char>(in)), istreambuf_iterator<char>());
+    vector<string> lines = loadLines(corpusPath);
+    if (text.compare(0, strlen(WorkloadCapture::MAGIC), WorkloadCapture::MAGIC) == 0) {
+        text.clear();
+        for (const string& line : lines) text += line;
+    }
+    if (text.empty()) {
+        cout << "Error! Corpus " << corpusPath << " is empty or unreadable." << endl;
+        return 1;
+    }
+    if (objective != "decode" && objective != "encode" && objective != "ratio") {
+        cout << "Error! Objective must be decode, encode or ratio." << endl;
+        return 1;
+    }
+
+    vector<ParetoPoint> points = exploreConfigurations(text, lines, 3);
+    markParetoFrontier(points);
+    if (!writeParetoCsv(csvPath, points)) {
+        cout << "\nError! Could not write " << csvPath << endl;
+        return 1;
+    }
+
+    cout << left << setw(11) << "Mode" << setw(36) << "Parameters" << setw(12) << "Encode MB/s" << setw(12)
+         << "Decode MB/s" << "Ratio" << endl;
+    cout << string(76, '-') << endl;
+    for (const ParetoPoint& point : points) {
+        if (!point.pareto) continue;
+        cout << left << setw(11) << point.mode << setw(36) << point.parameters << fixed << setprecision(1)
+             << setw(12) << point.encodeMBps << setw(12) << point.decodeMBps << setprecision(3) << point.ratio << endl;
+    }
+    cout.unsetf(ios::fixed);
+    cout << string(76, '-') << endl;
+    cout << points.size() << " configurations written to " << csvPath << endl;
+
+    int failed = count_if(points.begin(), points.end(), [](const ParetoPoint& point) { return !point.roundTrip; });
+    if (failed > 0) cout << failed << " configurations did not round-trip and were left off the frontier." << endl;
+
+    int best = recommendConfiguration(points, objective, minRatio);
+    if (best < 0) {
+        cout << "No configuration reaches a ratio of " << minRatio << "." << endl;
+        return 1;
+    }
+    cout << "Recommended for " << objective << " with ratio >= " << minRatio << ": " << points[best].mode
+         << (points[best].parameters.empty() ? "" : " " + points[best].parameters) << endl;
+    return 0;
+}
+
+// Summarize a capture file by entry point and payload size, then replay its
+// payloads through every configuration as the explore tool does
+int replayTool(const string& capturePath, const string& csvPath, const string& objective, double minRatio) {
+    workloadCapture().stop();  // Replaying must not sample its own calls
+    vector<pair<string, string>> payloads;
+    if (!WorkloadCapture::load(capturePath, payloads) || payloads.empty()) {
+        cout << "Error! " << capturePath << " is not a capture file with payloads." << endl;
+        return 1;
+    }
+
+    map<string, vector<size_t>> sizes;
+    for (const pair<string, string>& payload : payloads) sizes[payload.first].push_back(payload.second.length());
+    cout << left << setw(12) << "Source" << setw(10) << "Payloads" << setw(12) << "Bytes" << setw(10) << "p50"
+         << setw(10) << "p99" << "Max" << endl;
+    cout << string(64, '-') << endl;
+    for (pair<const string, vector<size_t>>& source : sizes) {
+        vector<size_t>& s = source.second;
+        sort(s.begin(), s.end());
+        size_t total = 0;
+        for (size_t n : s) total += n;
+        cout << left << setw(12) << source.first << setw(10) << s.size() << setw(12) << total << setw(10)
+             << s[s.size() / 2] << setw(10) << s[min(s.size() - 1, s.size() * 99 / 100)] << s.back() << endl;
+    }
+    cout << string(64, '-') << endl << endl;
+    return exploreTool(capturePath, csvPath, objective, minRatio);
+}
+
+// Make the request payloads of the load generator from a size spec:
+//   fixed:N          every payload is N bytes
+//   uniform:MIN:MAX  sizes are uniform between MIN and MAX bytes
+//   exp:MEAN         sizes are exponential with the given mean, as in most RPC traffic
+//   corpus:PATH      the messages of a corpus or capture file
+// Generated payloads are text over a skewed alphabet. Returns false for a bad spec.
+bool makePayloads(const string& spec, size_t count, vector<string>& payloads) {
+    payloads.clear();
+    if (spec.compare(0, 7, "corpus:") == 0) {
+        payloads = loadLines(spec.substr(7));
+        return !payloads.empty();
+    }
+
+    size_t first = 0, second = 0;
+    function<size_t(mt19937&)> size;
+    if (sscanf(spec.c_str(), "fixed:%zu", &first) == 1 && first > 0) {
+        size = [=](mt19937&) { return first; };
+    } else if (sscanf(spec.c_str(), "uniform:%zu:%zu", &first, &second) == 2 && first > 0 && first <= second) {
+        size = [=](mt19937& rng) { return uniform_int_distribution<size_t>(first, second)(rng); };
+    } else if (sscanf(spec.c_str(), "exp:%zu", &first) == 1 && first > 0) {
+        size = [=](mt19937& rng) { return 1 + (size_t)exponential_distribution<double>(1.0 / first)(rng); };
+    } else {
+        return false;
+    }
+
+    mt19937 rng(71);
+    for (size_t i = 0; i < count; i++) payloads.push_back(skewedText(size(rng), rng));
+    return true;
+}
+
+// LoadClientStats collects what one load generator client saw since the
+// reporter last took its numbers
+struct LoadClientStats {
+    mutex lock;  // Only contended when the reporter takes the numbers
+    vector<float> latencies;  // Microseconds per request
+    size_t bytes = 0;  // Payload bytes encoded and decoded
+    size_t errors = 0;  // Requests whose payload did not round-trip
+};
+
+// Drive the codebook registry with concurrent clients. Each request encodes
+// and decodes one payload. With qps 0 the loop is closed: every client sends
+// its next request as soon as the last one finished. Otherwise arrivals are
+// open: each client draws Poisson arrivals at qps / clients, and latency
+// counts from the scheduled arrival, so a stalled service is not hidden by
+// clients waiting on it. QPS, MB/s and latency percentiles are printed every second.
+int loadGenerator(int clients, int seconds, const string& sizes, double qps) {
+    vector<string> payloads;
+    if (!makePayloads(sizes, 4096, payloads)) {
+        cout << "Error! Size spec must be fixed:N, uniform:MIN:MAX, exp:MEAN or corpus:PATH." << endl;
+        return 1;
+    }
+    workloadCapture().stop();  // Generated load is not production traffic
+
+    CodebookRegistry registry;
+    registry.publish(vector<string>(payloads.begin(), payloads.begin() + min<size_t>(payloads.size(), 1024)));
+
+    typedef chrono::steady_clock clock;
+    vector<LoadClientStats> stats(clients);
+    atomic<bool> running(true);
+    clock::time_point start = clock::now();
+    vector<thread> threads;
+    for (int c = 0; c < clients; c++) {
+        threads.push_back(thread([&, c] {
+            mt19937 rng(73 + c);
+            exponential_distribution<double> gap(max(qps, 1e-9) / clients);
+            clock::time_point next = start;
+            while (running.load(memory_order_relaxed)) {
+                if (qps > 0) {
+                    next += chrono::duration_cast<clock::duration>(chrono::duration<double>(gap(rng)));
+                    this_thread::sleep_until(next);
+                    if (!running.load(memory_order_relaxed)) break;
+                } else {
+                    next = clock::now();
+                }
+                const string& payload = payloads[rng() % payloads.size()];
+                bool ok = registry.decode(registry.encode(payload)) == payload;
+                float micros = chrono::duration<float, micro>(clock::now() - next).count();
+
+                lock_guard<mutex> guard(stats[c].lock);
+                stats[c].latencies.push_back(micros);
+                stats[c].bytes += payload.length();
+                stats[c].errors += !ok;
+            }
+        }));
+    }
+
+    auto percentile = [](const vector<float>& v, double p) { return v.empty() ? 0.0f : v[min(v.size() - 1, (size_t)(p * v.size()))]; };
+    auto report = [&](const string& label, vector<float>& latencies, size_t bytes, double elapsed) {
+        sort(latencies.begin(), latencies.end());
+        cout << left << fixed << setprecision(0) << setw(8) << label << setw(11) << latencies.size() / elapsed
+             << setprecision(1) << setw(9) << bytes / 1e6 / elapsed << setw(10) << percentile(latencies, 0.5)
+             << setw(10) << percentile(latencies, 0.99) << setw(10) << percentile(latencies, 0.999)
+             << (latencies.empty() ? 0.0f : latencies.back()) << endl;
+        cout.unsetf(ios::fixed);
+    };
+
+    cout << clients << " clients, " << (qps > 0 ? "open loop at " + to_string((long long)qps) + " QPS" : string("closed loop"))
+         << ", sizes " << sizes << endl;
+    cout << left << setw(8) << "Second" << setw(11) << "QPS" << setw(9) << "MB/s" << setw(10) << "p50 us"
+         << setw(10) << "p99 us" << setw(10) << "p99.9 us" << "Max us" << endl;
+    cout << string(66, '-') << endl;
+    vector<float> all;
+    size_t totalBytes = 0, errors = 0;
+    for (int second = 1; second <= seconds; second++) {
+        this_thread::sleep_until(start + chrono::seconds(second));
+        vector<float> latencies;
+        size_t bytes = 0;
+        for (LoadClientStats& client : stats) {
+            lock_guard<mutex> guard(client.lock);
+            latencies.insert(latencies.end(), client.latencies.begin(), client.latencies.end());
+            client.latencies.clear();
+            bytes += client.bytes;
+            errors += client.errors;
+            client.bytes = client.errors = 0;
+        }
+        all.insert(all.end(), latencies.begin(), latencies.end());
+        totalBytes += bytes;
+        report(to_string(second), latencies, bytes, 1.0);
+    }
+    running = false;
+    for (thread& t : threads) t.join();
+
+    cout << string(66, '-') << endl;
+    report("total", all, totalBytes, seconds);
+    if (errors > 0) cout << errors << " requests did not round-trip." << endl;
+    return errors == 0 ? 0 : 1;
+}
+
+// Run a benchmark or tool named on the command line. Returns the process exit code.
+int runTool(int argc, char* argv[]) {
+    string tool = argv[1];
+
+    if (tool == "bench-hotswap") {
+        int readers = (argc > 2) ? atoi(argv[2]) : (int)max(1u, thread::hardware_concurrency());
+        int milliseconds = (argc > 3) ? atoi(argv[3]) : 500;
+        benchHotSwap(readers, milliseconds);
+        return 0;
+    }
+    if (tool == "bench-heap") {
+        int n = (argc > 2) ? atoi(argv[2]) : 100000;
+        int rounds = (argc > 3) ? atoi(argv[3]) : 20;
+        benchHeap(max(n, 256), max(rounds, 1));
+        return 0;
+    }
+
+    if (tool == "bench-interleave") {
+        int messages = (argc > 2) ? atoi(argv[2]) : 4000;
+        int size = (argc > 3) ? atoi(argv[3]) : 2000;
+        return benchInterleave(max(messages, 1), max(size, 1));
+    }
+    if (tool == "bench-flush") {
+        int lines = (argc > 2) ? atoi(argv[2]) : 20000;
+        int intervalMicros = (argc > 3) ? atoi(argv[3]) : 500;
+        benchFlush(max(lines, 1), max(intervalMicros, 0));
+        return 0;
+    }
+    if (tool == "bench-batch") {
+        int blocks = (argc > 2) ? atoi(argv[2]) : 4096;
+        int blockSize = (argc > 3) ? atoi(argv[3]) : 1024;
+        return benchBatch(max(blocks, 1), max(blockSize, 1));
+    }
+    if (tool == "bench-tiny") {
+        return benchTiny(max((argc > 2) ? atoi(argv[2]) : 200000, 1));
+    }
+    if (tool == "bench-histogram") {
+        benchHistogram(max((argc > 2) ? atoi(argv[2]) : 64, 1));
+        return 0;
+    }
+    if (tool == "bench-ingest") {
+        return benchIngest(max((argc > 2) ? atoi(argv[2]) : 64, 1));
+    }
+    if (tool == "bench-json") {
+        return benchJson(max((argc > 2) ? atoi(argv[2]) : 20000, 1));
+    }
+    if (tool == "bench-sparse") {
+        return benchSparse(max((argc > 2) ? atoi(argv[2]) : 4, 1));
+    }
+    if (tool == "bench-logs") {
+        int lines = (argc > 2) ? atoi(argv[2]) : 200000;
+        int threads = (argc > 3) ? atoi(argv[3]) : (int)thread::hardware_concurrency();
+        return benchLogs(max(lines, 1), max(threads, 1));
+    }
+    if (tool == "bench-mux") {
+        int streams = (argc > 2) ? atoi(argv[2]) : 5000;
+        int messages = (argc > 3) ? atoi(argv[3]) : 200000;
+        int resident = (argc > 4) ? atoi(argv[4]) : 4096;
+        return benchMux(max(streams, 1), max(messages, 1), max(resident, 1));
+    }
+    if (tool == "bench-lazymap") {
+        int megabytes = (argc > 2) ? atoi(argv[2]) : 32;
+        int touches = (argc > 3) ? atoi(argv[3]) : 100;
+        int cacheBlocks = (argc > 4) ? atoi(argv[4]) : 64;
+        int readahead = (argc > 5) ? atoi(argv[5]) : 1;
+        return benchLazyMap(max(megabytes, 1), max(touches, 1), max(cacheBlocks, 1), max(readahead, 0));
+    }
+    if (tool == "bench-delta") {
+        int megabytes = (argc > 2) ? atoi(argv[2]) : 64;
+        int edits = (argc > 3) ? atoi(argv[3]) : 200;
+        return benchDelta(max(megabytes, 1), max(edits, 0));
+    }
+    if (tool == "bench-hardened") {
+        return benchHardened(max((argc > 2) ? atoi(argv[2]) : 16, 1));
+    }
+    if (tool == "fuzz-decoder") {
+        return fuzzDecoderTool(max((argc > 2) ? atoi(argv[2]) : 100000, 1));
+    }
+    if (tool == "bench-cache") {
+        int megabytes = (argc > 2) ? atoi(argv[2]) : 64;
+        int lookups = (argc > 3) ? atoi(argv[3]) : 200000;
+        return benchCache(max(megabytes, 1), max(lookups, 100));
+    }
+    if (tool == "explore" && argc > 2) {
+        string csvPath = (argc > 3) ? argv[3] : "pareto.csv";
+        string objective = (argc > 4) ? argv[4] : "decode";
+        double minRatio = (argc > 5) ? atof(argv[5]) : 1.0;
+        return exploreTool(argv[2], csvPath, objective, minRatio);
+    }
+    if (tool == "replay" && argc > 2) {
+        string csvPath = (argc > 3) ? argv[3] : "pareto.csv";
+        string objective = (argc > 4) ? argv[4] : "decode";
+        double minRatio = (argc > 5) ? atof(argv[5]) : 1.0;
+        return replayTool(argv[2], csvPath, objective, minRatio);
+    }
+    if (tool == "loadgen") {
+        int clients = (argc > 2) ? atoi(argv[2]) : (int)max(1u, thread::hardware_concurrency());
+        int seconds = (argc > 3) ? atoi(argv[3]) : 10;
+        string sizes = (argc > 4) ? argv[4] : "exp:512";
+        double qps = (argc > 5) ? atof(argv[5]) : 0;
+        return loadGenerator(max(clients, 1), max(seconds, 1), sizes, max(qps, 0.0));
+    }
+    if (tool == "soak") {
+        long long cycles = (argc > 2) ? atoll(argv[2]) : 1000000;
+        int samples = (argc > 3) ? atoi(argv[3]) : 20;
+        return soak(max(cycles, 1LL), max(samples, 4));
+    }
+    if (tool == "autotune") {
+        string path = (argc > 2) ? argv[2] : tuningProfilePath();
+        TuningProfile profile = autotune(true);
+        if (!saveTuningProfile(path, profile) || !applyTuningProfile(profile)) {
+            cout << "\nError! Could not write " << path << endl;
+            return 1;
+        }
+        cout << "Profile for " << profile.cpu << " written to " << path << ": histogram=" << profile.histogram
+             << ", decode_ways=" << profile.decodeWays << ", block_size=" << profile.blockSize << endl;
+        return 0;
+    }
+    if (tool == "train-codebooks" && argc > 3) {
+        return trainCodebooks(argv[2], atoi(argv[3]), (argc > 4) ? argv[4] : "");
+    }
+
+    cout << "Usage: " << argv[0] << " [tool] [arguments]\n\n";
+    cout << "Without a tool the interactive menu is started. Tools:\n";
+    cout << "  bench-hotswap [readers] [ms]   Codebook hot-swap read-side scaling\n";
+    cout << "  bench-heap [n] [rounds]        DaryHeap against std::priority_queue and PriorityQueue\n";
+    cout << "  bench-interleave [messages] [size]  decode() per message against interleaved decoding\n";
+    cout << "  train-codebooks corpus K [out] Train K codebooks on a corpus (one message per line)\n";
+    cout << "  bench-flush [lines] [us]       Latency and ratio of the streaming flush policies\n";
+    cout << "  bench-batch [blocks] [size]    Batch code-length builder against the per-block builders\n";
+    cout << "  bench-tiny [messages]          Latency of the tiny-message path against its p99 target\n";
+    cout << "  bench-histogram [MB]           Histogram kernels on uniform, skewed and single-byte data\n";
+    cout << "  bench-ingest [MB]              Fused copy/count/checksum against separate passes\n";
+    cout << "  bench-json [records]           Split JSON streams against one byte-level table\n";
+    cout << "  bench-sparse [MB]              Zero-run coding against one byte-level table on sparse data\n";
+    cout << "  bench-logs [lines] [threads]   Log template extraction against one byte-level table\n";
+    cout << "  bench-mux [streams] [messages] [resident]  Multiplexed streams against one frame per message\n";
+    cout << "  bench-lazymap [MB] [reads] [cache] [readahead]  Lazy userfaultfd mapping against full decode\n";
+    cout << "  bench-delta [MB] [edits]       Diff against a reference and apply the patch\n";
+    cout << "  bench-hardened [MB]            Hardened packed decoder against bit-at-a-time decoding\n";
+    cout << "  fuzz-decoder [iterations]      Decode mutated encodings with every untrusted-input decoder\n";
+    cout << "  bench-cache [MB] [lookups]     Compressed cache capacity and hit latency against raw values\n";
+    cout << "  explore corpus [csv] [decode|encode|ratio] [min-ratio]  Pareto frontier of all configurations\n";
+    cout << "  replay capture [csv] [decode|encode|ratio] [min-ratio]  Replay a HUFFMAN_CAPTURE file through explore\n";
+    cout << "  loadgen [clients] [s] [sizes] [qps]  Concurrent clients against the codebook registry; qps 0 is closed loop\n";
+    cout << "  soak [cycles] [samples]        Long encode/decode run that fails if memory or latency trends upward\n";
+    cout << "  autotune [profile]             Measure kernel choices and write a tuning profile\n";
+    return 1;
+}
+
+// Display the main menu for user interaction
+void MainMenu(){
+    cout << "\n\n--------------Welcome to Huffman Coding --------------\n\n";
+    cout << "1. Enter String and Encode/Decode\n";
+    cout << "2. Exit\n";
+    cout << "\nEnter your choice: ";
+}
+
+// Validate if the user's choice is either 1 or 2
+bool isValidChoice(const string& choice) {
+    stringstream ss(choice);
+    int num;
+    ss >> num;
+    return !ss.fail() && ss.eof() && (num == 1 || num == 2);
+}
+
+// Main function to execute the Huffman coding process
+#ifndef HUFFMAN_FUZZ  // libFuzzer provides main
+int main(int argc, char* argv[]) {
+    loadTuningProfile(tuningProfilePath());  // Kernel choices measured by the autotune tool, if any
+    startCaptureFromEnvironment();  // Sample encoded payloads when HUFFMAN_CAPTURE is set
+    if (argc > 1) return runTool(argc, argv);  // Benchmarks and tools run without the menu
+
+    int choice;
+    string myString;
+    string encoded, decoded;
+    unordered_map<char, string> codes;
+    FrequencyTable table;
+    HuffmanTree hTree;
+    string inputChoice;
+
+    do {
+        MainMenu();  // Display the menu
+        getline(cin, inputChoice);  // Get user input for menu choice
 
         if (isValidChoice(inputChoice)) {
             stringstream(inputChoice) >> choice;
@@ -344,6 +6581,7 @@ int main() {
 
                     // Step 1: Create a Frequency Table
                     cout << "\nStep 1: Create a Frequency Table\n\n";
+                    table.Clear();  // The table is reused for every string
                     table.sethuffmanString(myString);
                     table.MakeTable();
                     cout << "\n------------ Frequency Table ------------\n\n";
@@ -357,7 +6595,7 @@ int main() {
                     cout << left << setw(15) << "Character" << setw(20) << "Huffman Code" << endl;
                     cout << string(35, '-') << endl;
 
-                    for (const pair<char, string>& p : codes) {
+                    for (const pair<const char, string>& p : codes) {
                         cout << left << setw(15) << p.first << setw(20) << p.second << endl;
                     }
                     cout << string(35, '-') << endl;
@@ -383,6 +6621,9 @@ int main() {
                     cout << "\nOriginal Size (in bits): " << myString.length() * 8 << endl;
                     cout << "Encoded Size (in bits): " << encoded.length() << endl;
                     cout << "Compression Ratio: " << (float)encoded.length() / (myString.length() * 8) * 100 << "%\n";
+
+                    cout << "\n------------ Code Quality ------------\n\n";
+                    DisplayReport(analyzeCodes(table, hTree, codes));
                     break;
 
                 case 2:
@@ -400,3 +6641,4 @@ int main() {
     cout << endl << endl;
     return 0;
 }
+#endif